@@ -0,0 +1,96 @@
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+#define CHUNK_SIZE 65536
+
+/* Every block is aligned for any type the assembler stores in it. */
+union Align {
+    long l;
+    double d;
+    void *p;
+};
+#define ROUND_UP(n) (((n) + sizeof(union Align)-1) & ~(sizeof(union Align)-1))
+
+struct ArenaChunk {
+    struct ArenaChunk *next;
+    union Align data[1];
+};
+
+static void *new_chunk(struct Arena *a, size_t n);
+
+
+void *arena_alloc(struct Arena *a, size_t n)
+{
+    void *p;
+    n = ROUND_UP(n);
+    if ((size_t)(a->end - a->next) < n)
+      return new_chunk(a, n);
+    p = a->next;
+    a->next += n;
+    return p;
+}
+
+char *arena_strndup(struct Arena *a, const char *text, size_t len)
+{
+    char *p = arena_alloc(a, len+1);
+    memcpy(p, text, len);
+    p[len] = '\0';
+    return p;
+}
+
+char *arena_strdup(struct Arena *a, const char *text)
+{
+    return arena_strndup(a, text, strlen(text));
+}
+
+void *arena_grow(struct Arena *a, void *p, size_t oldn, size_t newn)
+{
+    void *newp;
+    if (p == NULL)
+      return arena_alloc(a, newn);
+    if (newn <= oldn)
+      return p;
+    if ((char *)p + ROUND_UP(oldn) == a->next &&
+        (size_t)(a->end - (char *)p) >= newn) {
+        a->next = (char *)p + ROUND_UP(newn);
+        return p;
+    }
+    newp = arena_alloc(a, newn);
+    memcpy(newp, p, oldn);
+    return newp;
+}
+
+void arena_release(struct Arena *a)
+{
+    while (a->chunks != NULL) {
+        struct ArenaChunk *next = a->chunks->next;
+        free(a->chunks);
+        a->chunks = next;
+    }
+    a->next = a->end = NULL;
+}
+
+
+/* Get a new chunk with room for at least 'n' bytes, and return the
+ * first 'n' of them. A block too big to share a chunk gets a chunk of
+ * its own, kept behind the current one, so that the free space left
+ * in the current chunk isn't wasted. */
+static void *new_chunk(struct Arena *a, size_t n)
+{
+    size_t size = (n > CHUNK_SIZE/4)? n: CHUNK_SIZE;
+    struct ArenaChunk *cp = malloc(offsetof(struct ArenaChunk, data) + size);
+    assert(cp != NULL);
+    if (size != n || a->chunks == NULL) {
+        cp->next = a->chunks;
+        a->chunks = cp;
+        a->next = (char *)cp->data + n;
+        a->end = (char *)cp->data + size;
+    } else {
+        cp->next = a->chunks->next;
+        a->chunks->next = cp;
+    }
+    return cp->data;
+}
@@ -0,0 +1,32 @@
+
+#ifndef H_ARENA
+ #define H_ARENA
+
+#include <stddef.h>  /* for the |size_t| type */
+
+/* A region allocator. Blocks are carved out of large chunks, so that
+ * allocating one is usually just a pointer bump, and there's no way to
+ * free one; arena_release() frees everything in the arena at once.
+ * A zeroed struct Arena is empty and ready to use. Running out of
+ * memory is fatal, as it is everywhere else in the assembler. */
+
+struct ArenaChunk;
+
+struct Arena {
+    struct ArenaChunk *chunks;
+    char *next;  /* the free space in the current chunk */
+    char *end;
+};
+
+void *arena_alloc(struct Arena *a, size_t n);
+char *arena_strndup(struct Arena *a, const char *text, size_t len);
+char *arena_strdup(struct Arena *a, const char *text);
+
+/* Like realloc(): return a block of 'newn' bytes holding the first
+ * 'oldn' bytes of 'p'. The last block allocated grows in place if
+ * there's room; otherwise, the old block is simply abandoned. */
+void *arena_grow(struct Arena *a, void *p, size_t oldn, size_t newn);
+
+void arena_release(struct Arena *a);
+
+#endif
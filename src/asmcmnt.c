@@ -136,7 +136,6 @@ void mark_comments(struct Section *sp)
                 pull_out_delimiters(r, s);
                 if (s->text[0] == '\0') {
                     /* Remove the empty string left behind by a deleted comment. */
-                    free(s->text);
                     r->len -= 1;
                     memmove(&r->s[j], &r->s[j+1], (r->len - j) * sizeof *s);
                     j -= 1;
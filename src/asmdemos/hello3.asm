@@ -0,0 +1,14 @@
+
+  .EQU #EXIT 2
+  .EQU #STRPOS 3
+  .EQU #STRDIR 4
+  .EQU #PUTZ 6
+
+  {Print the whole string with one write to the string output device.}
+  .ENTRY .+(0,1)    .ORG (10,10)
+  GOE               LI $3, data       LV.y $3, data     SMR $3, #STRPOS   LI $3, 1          SMR $3, #STRDIR   SMR $0, #PUTZ     SMR $0, #EXIT
+
+
+
+  .EQU data .+(0,1)   .ORG (42d,42d)
+  WORD 'H'  WORD 'e'  WORD 'l'  WORD 'l'  WORD 'o'  WORD ','  WORD ' '  WORD 'w'  WORD 'o'  WORD 'r'  WORD 'l'  WORD 'd'  WORD '!'  WORD '\n'  WORD '\0'
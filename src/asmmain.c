@@ -1,10 +1,14 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include "arena.h"
 #include "getline.h"
 #include "fungal.h"
 #include "fungelf.h"
@@ -13,31 +17,58 @@
 #define TABSTOP 8
 #define NELEM(a) ((int)(sizeof a / sizeof *a))
 
+struct Band;
+struct CodeCache;
+
+#ifndef FUNGASM_LIBRARY
 static int assemble_file(FILE *in, FILE *out);
- static struct Section *new_Section(struct Section *next);
- static void kill_Section(struct Section *sp);
- static void add_row(struct Section *sp, const struct Row *r);
- static struct Row *split_strings(const char *line);
-  static int detab_selection(char *bp, const char *text, int len, int realpos);
+#endif
+static void assemble_source(void);
+static int catch_fatal(void (*fn)(void));
+static void abandon_program(void);
+ static void begin_program(void);
+  static struct Section *new_Section(struct Section *next);
+ static void add_line(const char *line);
+  static void add_row(struct Section *sp, const struct Row *r);
+  static struct Row *split_strings(const char *line);
+   static int detab_selection(char *bp, const char *text, int len, int realpos);
+ static void assemble_program(FILE *out);
 
  static void resolve_grid(struct Section *sp);
  static void extract_directives(struct Section *sp);
-  static int add_macro(struct MacroDef **mp, const char *text, int textlen,
+  static int add_macro(struct Section *sp, const char *text, int textlen,
                         const char *replacement);
-  static void replace_dot(char **ptext, int x, int y);
+  static int replace_dot(char **ptext, int x, int y);
  static struct EquDef *new_Equ(const char *text, int len,
          const char *replacement, struct EquDef *next);
   static struct EquDef *find_equ(const char *text, int len);
- static void kill_Equ(struct EquDef *ep);
 
  static void decide_global(struct Section *sp);
 
  static void resolve_macros(struct Section *sp, char **text);
-  static struct MacroDef *find_macro(struct MacroDef *mlist, const char *text, int len);
+  static struct MacroDef *find_macro(const struct Section *scope,
+                                     const char *text, int len);
   static char *find_identifier(const char *text, int *len);
 
+ static struct Symbol *find_symbol(const char *text, int len, int create);
+  static unsigned int hash_name(const char *text, int len);
+  static void grow_symbols(void);
+ static void kill_symbols(void);
+
  static void trim_section(struct Section *sp);
+ static void resolve_equs(void);
+ static void prepare_section(struct Section *sp);
+ static int queue_bands(struct Section *sp, struct Band *b);
+ static void start_workers(int nbands);
+  static void *band_worker(void *unused);
+   static void assemble_band(struct Band *b, struct CodeCache *cache);
+    static unsigned int cached_fungasm(struct CodeCache *cache, const char *text);
+     static void grow_cache(struct CodeCache *cache);
+   static void kill_cache(struct CodeCache *cache);
+ static void wait_band(struct Band *b);
+ static void stop_workers(void);
  static unsigned int makebgfill(const struct Section *sp);
+ static void write_symbol_map(FILE *fp);
  static void kill_all_globals(void);
 
 unsigned int true_value(const char *equname, int len);
@@ -45,13 +76,50 @@ unsigned int true_value(const char *equname, int len);
 void fatal_error(const struct Row *r, int pos, const char *msg, ...);
 void warning(const struct Row *r, int pos, const char *msg, ...);
  static int print_Row(FILE *fp, const struct Row *r, int arrow);
+static void progress(const char *fmat, ...);
+#ifndef FUNGASM_LIBRARY
 static void dohelp(int man);
+#endif
 
 
+static FILE *mapfp = NULL;
+static FILE *streamfp = NULL;  /* the output, if sections go straight to it */
+static int NumThreads = 0;  /* 0 means one per CPU */
+
+/* When the assembler is used as a library, it keeps quiet, and a
+ * fatal error jumps back to catch_fatal() instead of exiting. */
+static int Quiet = 0;
+static jmp_buf *fatal_jmp = NULL;
+static char *fatal_msg = NULL;
+static size_t fatal_msglen = 0;
+
+#ifndef FUNGASM_LIBRARY
 int main(int argc, const char *argv[])
 {
     FILE *in, *out;
 
+    while (argc > 2 && argv[1][0] == '-') {
+        if (!strcmp(argv[1], "-m")) {
+            mapfp = fopen(argv[2], "w");
+            if (mapfp == NULL)
+              fatal_error(NULL, -1, "File \"%s\" could not be opened.", argv[2]);
+            argc -= 2;
+            argv += 2;
+        } else if (!strcmp(argv[1], "-z")) {
+            FungELF_packtext(1);
+            argc -= 1;
+            argv += 1;
+        } else if (!strcmp(argv[1], "-j") && argc > 3) {
+            NumThreads = atoi(argv[2]);
+            if (NumThreads < 1)
+              dohelp(1);
+            argc -= 2;
+            argv += 2;
+        } else {
+            dohelp(1);
+        }
+    }
+
     if (argc != 2 && argc != 3)
       dohelp(1);
 
@@ -78,24 +146,206 @@ int main(int argc, const char *argv[])
     if (assemble_file(in, out) != 0) {
         puts("An error was encountered while assembling the file.");
     }
-    fclose(out);
+    if (fclose(out) != 0)
+      fatal_error(NULL, -1, "The ELF file could not be written.");
+    if (mapfp != NULL)
+      fclose(mapfp);
     return 0;
 }
+#endif
 
 
 static struct EquDef *global_equs = NULL;
 static struct Section *secthead = NULL;
+static struct Section *cursect = NULL;  /* the one add_line() adds to */
+static int source_line = 0;  /* the number of lines add_line() has had */
 static struct MacroDef *global_macros = NULL;
 static unsigned int global_entry = -1u;
 static unsigned int global_fillvalue = -1u;
 static unsigned int global_flags = 0u;
 
-
+/* Everything in the parse tree, from the Sections down to the text
+ * of each String, and every EQU, macro and symbol, lives here until
+ * the end of assemble_file(). */
+static struct Arena arena;
+
+/* The cells of a section are assembled a band of rows at a time, by a
+ * pool of NumThreads threads. An error in a band is kept until its
+ * section is written out, so that the error reported is always the
+ * first one in the file, however the bands were scheduled. The EQUs
+ * are all resolved beforehand, so the threads only read them. */
+#define BAND_ROWS 16
+/* Sections are queued only this many cells ahead of the one being
+ * written, so that the whole program's cells are never held at once. */
+#define QUEUE_AHEAD (512*512)
+
+struct Band {
+    struct Section *sp;
+    int first, last;  /* rows [first, last) */
+    int done;
+    const struct Row *err_row;
+    int err_pos;
+    const char *err_msg;  /* err_buf, or an EQU's error */
+    char err_buf[100];
+};
+static struct Band *bands = NULL;
+static int nbands_queued = 0;
+static int nbands_taken = 0;
+static int nbands_total = 0;
+static pthread_t *workers = NULL;
+static int nworkers = 0;
+static pthread_mutex_t band_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t band_changed = PTHREAD_COND_INITIALIZER;
+static int resolving_equs = 0;  /* set by resolve_equs() */
+static _Thread_local const char *equ_error;  /* the first a cell hit */
+
+/* Sources repeat the same few instructions thousands of times, so each
+ * thread that assembles cells remembers the code for each text it has
+ * assembled. The text is the cell's final text, with macros and dots
+ * already expanded, and an EQU never changes once it has a value, so
+ * an entry stays good for the rest of the assembly. A text that fails
+ * isn't remembered, since its message is in a reusable buffer. The
+ * hit counts are totalled, under band_lock, as each cache is freed. */
+struct CachedCode {
+    const char *text;  /* NULL if the slot is empty */
+    unsigned int hash;
+    unsigned int code;
+};
+struct CodeCache {
+    struct CachedCode *slots;
+    unsigned int mask;  /* number of slots, minus 1 */
+    unsigned int count;
+    unsigned long lookups, hits;
+};
+static struct CodeCache main_cache;  /* for when there are no workers */
+static unsigned long cache_lookups = 0;
+static unsigned long cache_hits = 0;
+
+/* Every .EQU and .MACRO name is interned in one hash table, so that
+ * looking up an identifier costs one hash and one string compare, no
+ * matter how many symbols the program defines. A name can be one EQU
+ * and any number of macros, at most one per scope. The lists above
+ * still own the definitions, and keep them in order. */
+struct Symbol {
+    char *name;
+    unsigned int hash;
+    struct EquDef *equ;
+    struct MacroDef *macros;
+    struct Symbol *next;
+};
+static struct Symbol **symbols = NULL;
+static unsigned int nsymbols = 0;
+static unsigned int symbols_mask = 0;  /* number of buckets, minus 1 */
+
+
+#ifndef FUNGASM_LIBRARY
 static int assemble_file(FILE *in, FILE *out)
 {
     char *line = NULL;
-    struct Section *sp, **psp;
-    struct EquDef *ep;
+
+    begin_program();
+    while (fgetline_notrim(&line, in) != NULL) {
+        assert(line != NULL);
+        add_line(line);
+        free(line);
+        line = NULL;
+    }
+
+    /* Now everything is in the form of Strings and Sections. */
+    free(line);
+    fclose(in);
+
+    assemble_program(out);
+    return 0;
+}
+#endif
+
+static const char *source_text;
+static size_t source_len;
+
+/* The assembler as a library: assemble the program in 'text', which
+ * is 'len' bytes long, straight into memory, reading and writing no
+ * files and printing nothing. Returns NULL if the program has an
+ * error, with the message in 'errbuf', after the line and column it
+ * was found at, if it has them; whatever had been allocated
+ * is freed, so the next call starts afresh. Only one assembly can be
+ * in progress at a time, and its cells are assembled on the calling
+ * thread, so that a fatal error can jump straight back here. */
+struct FungELF_Image *fungasm_source(const char *text, size_t len,
+                                     char *errbuf, size_t errlen)
+{
+    struct FungELF_Image *img = NULL;
+    int numthreads = NumThreads;
+
+    source_text = text;
+    source_len = len;
+    fatal_msg = errbuf;
+    fatal_msglen = errlen;
+    Quiet = 1;
+    NumThreads = 1;
+    if (catch_fatal(assemble_source) == 0)
+      img = FungELF_takeimage();
+    else
+      abandon_program();
+    Quiet = 0;
+    NumThreads = numthreads;
+    return img;
+}
+
+/* Split the source into lines, as fgetline_notrim() would,
+ * and assemble them. */
+static void assemble_source(void)
+{
+    const char *text = source_text;
+    size_t len = source_len;
+
+    begin_program();
+    while (len > 0) {
+        const char *nl = memchr(text, '\n', len);
+        size_t n = (nl != NULL)? (size_t)(nl+1 - text): len;
+        add_line(arena_strndup(&arena, text, n));
+        text += n;
+        len -= n;
+    }
+    assemble_program(NULL);
+}
+
+/* Call 'fn', returning 0 if it finishes, or -1 if it hits a fatal
+ * error. The setjmp() is kept out here, away from the code it
+ * protects, whose locals needn't survive the longjmp(). */
+static int catch_fatal(void (*fn)(void))
+{
+    jmp_buf env;
+    int rc = -1;
+    if (setjmp(env) == 0) {
+        fatal_jmp = &env;
+        fn();
+        rc = 0;
+    }
+    fatal_jmp = NULL;
+    return rc;
+}
+
+/* After a fatal error, free whatever the assembly had got as far
+ * as allocating. */
+static void abandon_program(void)
+{
+    struct Section *sp;
+    stop_workers();
+    for (sp = secthead; sp != NULL; sp = sp->next) {
+        free(sp->assembled);
+        sp->assembled = NULL;
+    }
+    FungELF_done();
+    kill_all_globals();
+}
+
+static void begin_program(void)
+{
+    global_entry = -1u;
+    global_fillvalue = -1u;
+    global_flags = 0u;
+    source_line = 0;
 
     /* Built-in register names. */
     global_equs = new_Equ("PC", 2, "1", global_equs);
@@ -118,39 +368,44 @@ static int assemble_file(FILE *in, FILE *out)
     global_equs = new_Equ("IRET", 2, "052", global_equs);
     global_equs = new_Equ("TICKS", 2, "070", global_equs);
 
-    secthead = sp = new_Section(NULL);
+    secthead = cursect = new_Section(NULL);
+}
 
-    while (fgetline_notrim(&line, in) != NULL) {
-        struct Row *r;
-        assert(line != NULL);
-        r = split_strings(line);
-        if (r == NULL) {
-            /* An empty line. This section is done! */
-            if (sp->rowslen != 0) {
-                sp->next = new_Section(NULL);
-                sp = sp->next;
-            }
-        } else {
-            add_row(sp, r);
+static void add_line(const char *line)
+{
+    struct Row *r = split_strings(line);
+    source_line += 1;
+    if (r == NULL) {
+        /* An empty line. This section is done! */
+        if (cursect->rowslen != 0) {
+            cursect->next = new_Section(NULL);
+            cursect = cursect->next;
         }
-        free(line);
-        line = NULL;
+    } else {
+        r->line = source_line;
+        add_row(cursect, r);
     }
+}
 
-    /* Now everything is in the form of Strings and Sections. */
-    free(line);
-    fclose(in);
+/* Assemble the Sections, and write them to 'out'; or, if 'out' is
+ * NULL, leave them with felfout for FungELF_takeimage(). */
+static void assemble_program(FILE *out)
+{
+    struct Section *sp, *qp, **psp;
+    struct EquDef *ep;
+    unsigned int nsections;
+    int nbands, nqueued, k;
+    long ahead;
 
     /* Do all the processing that definitely won't require
      * resolving any EQU or MACRO directives. */
 
-puts("Resolving grid...");
-puts("Extracting directives, macros, and equs...");
+progress("Resolving grid...\n");
+progress("Extracting directives, macros, and equs...\n");
     for (sp = secthead; sp != NULL; sp = sp->next) {
         /* Remove the leftover "empty" section from the end of the section list. */
         if (sp->next != NULL && sp->next->rowslen == 0) {
             assert(sp->next->next == NULL);
-            free(sp->next);
             sp->next = NULL;
         } else {
             assert(sp->rowslen > 0);
@@ -162,7 +417,7 @@ puts("Extracting directives, macros, and equs...");
         decide_global(sp);
     }
 
-puts("Resolving dots in .EQU expansions...");
+progress("Resolving dots in .EQU expansions...\n");
     for (ep = global_equs; ep != NULL; ep = ep->next) {
         if ((ep->sp == NULL) || ep->sp->global) {
             /* Can't replace_dot() in a global section; it has no location.
@@ -176,12 +431,12 @@ puts("Resolving dots in .EQU expansions...");
             assert(ep->s != NULL);
             x = (ep->sp->org_x + ep->s->x);
             y = (ep->sp->org_y + ep->s->y);
-            replace_dot(&ep->replacement, x, y);
+            ep->is_location = replace_dot(&ep->replacement, x, y);
         }
     }
 
     /* Now replace all macros. Macros are literal text replacement. */
-puts("Resolving macros in sections...");
+progress("Resolving macros in sections...\n");
     for (sp = secthead; sp != NULL; sp = sp->next) {
         int i, j;
         for (i=0; i < sp->rowslen; ++i) {
@@ -200,12 +455,10 @@ puts("Resolving macros in sections...");
                 if (!strncmp(s->text, ".ENTRY", 6) && isspace(s->text[6])) {
                     int len;
                     char *entry_expr;
-printf("  Found .ENTRY at (%d,%d) in section\n", s->x, s->y);
+progress("  Found .ENTRY at (%d,%d) in section\n", s->x, s->y);
                     if (global_entry != -1u)
                       fatal_error(&sp->rows[i], s->start, "Only one .ENTRY directive allowed in program");
-                    entry_expr = malloc(strlen(s->text+7)+1);
-                    assert(entry_expr != NULL);
-                    strcpy(entry_expr, s->text+7);
+                    entry_expr = arena_strdup(&arena, s->text+7);
                     if (!sp->global) {
                         assert(sp->org_x != -1u);
                         replace_dot(&entry_expr,
@@ -217,7 +470,6 @@ printf("  Found .ENTRY at (%d,%d) in section\n", s->x, s->y);
                     if (entry_expr[len] != '\0')
                       fatal_error(&sp->rows[i], s->start+7, "Extra text after scalar in .ENTRY directive");
                     global_entry &= ~IS_VECTOR;
-                    free(entry_expr);
                 }
             }
         }
@@ -226,17 +478,14 @@ printf("  Found .ENTRY at (%d,%d) in section\n", s->x, s->y);
     if (global_entry == -1u)
       warning(NULL, -1, "Program contains no .ENTRY directive");
 
-puts("Deleting global sections...");
+progress("Deleting global sections...\n");
     for (psp = &secthead; (*psp) != NULL; ) {
         struct Section *sp = *psp;
         assert((sp->org_x == -1u) == (sp->org_y == -1u));
         if ((*psp)->global) {
             /* No need to keep global sections around. */
             assert(sp->org_x == -1u);
-            sp = *psp;
             *psp = (*psp)->next;
-            kill_Section(sp);
-            free(sp);
         } else {
             /* Non-global sections had better have an ORG directive. */
             assert(sp->rowslen > 0);
@@ -248,7 +497,7 @@ puts("Deleting global sections...");
         }
     }
 
-puts("Resolving macros in EQUs...");
+progress("Resolving macros in EQUs...\n");
     for (ep = global_equs; ep != NULL; ep = ep->next) {
         if (ep->value == -1u) {
             resolve_macros(NULL, &ep->replacement);
@@ -256,26 +505,51 @@ puts("Resolving macros in EQUs...");
         }
     }
 
-puts("Trimming sections and marking BSS...");
+progress("Trimming sections and marking BSS...\n");
     for (sp = secthead; sp != NULL; sp = sp->next)
       trim_section(sp);
 
-puts("Dumping ELF binary...");
+progress("Dumping ELF binary...\n");
+    /* Each section is written out as soon as it's assembled, if the
+     * output can seek back to fill in the headers at the end. */
+    nsections = 0;
+    for (sp = secthead; sp != NULL; sp = sp->next)
+      nsections += !sp->global;
+    if (out != NULL && FungELF_stream(out, nsections) == 0)
+      streamfp = out;
     if (global_entry != -1u)
       FungELF_entrypoint(global_entry);
     if (global_fillvalue != -1u)
       FungELF_fillvalue(global_fillvalue);
 
-    /* Now parse and assemble each individual cell. */
+    /* Now parse and assemble each individual cell. The dots are
+     * replaced here, in order, but the cells are assembled by the
+     * worker threads; each section is written out as soon as all
+     * its bands are done. The sections after it are queued up to
+     * QUEUE_AHEAD cells ahead, to keep the workers busy meanwhile. */
+    nbands = 0;
     for (sp = secthead; sp != NULL; sp = sp->next) {
-        int i, j;
+        if (!sp->global && !sp->is_bss)
+          nbands += (sp->size_y + BAND_ROWS-1) / BAND_ROWS;
+    }
+    resolve_equs();
+    start_workers(nbands);
+    qp = secthead;
+    nqueued = 0;
+    ahead = 0;
+    for (sp = secthead, k = 0; sp != NULL; sp = sp->next) {
         unsigned int e_origin = (sp->org_y << 9) | sp->org_x;
         unsigned int e_size = (sp->size_y << 9) | sp->size_x;
         unsigned int e_flags;
 
-        assert(sp->size_x >= 0);
-        assert(sp->size_y >= 0);
-        assert(!sp->size_x == !sp->size_y);
+        while (qp != NULL && (qp == sp || (nworkers != 0 && ahead < QUEUE_AHEAD))) {
+            if (!qp->global && !qp->is_bss) {
+                prepare_section(qp);
+                nqueued += queue_bands(qp, &bands[nqueued]);
+                ahead += qp->size_x * qp->size_y;
+            }
+            qp = qp->next;
+        }
 
         if (sp->global) {
             /* it's been deleted by trim_section() */
@@ -288,34 +562,10 @@ puts("Dumping ELF binary...");
             continue;
         }
 
-        sp->assembled = malloc(sp->size_x * sp->size_y * sizeof *sp->assembled);
-        assert(sp->assembled != NULL);
-
-        if (sp->fillvalue != -1u) {
-            assert((sp->fillvalue & ~0777777) == 0);
-            for (i=0; i < sp->size_x * sp->size_y; ++i)
-              sp->assembled[i] = sp->fillvalue;
-        } else {
-            memset(sp->assembled, 0xFF,
-                sp->size_x * sp->size_y * sizeof *sp->assembled);
-        }
-
-        for (i=0; i < sp->size_y; ++i) {
-            assert(i < sp->rowslen);
-            for (j=0; j < sp->rows[i].len; ++j) {
-                struct String *s = &sp->rows[i].s[j];
-                unsigned int code;
-                assert(s != NULL);
-                if (s->comment) continue;
-                if (s->x >= sp->size_x) break;
-                assert(s->y == i);
-                if (s->text[0] == '.') continue;
-                replace_dot(&s->text, sp->org_x+s->x, sp->org_y+s->y);
-                code = fungasm(s->text);
-                if (code & ~0777777)
-                  fatal_error(&sp->rows[i], s->start, fungasm_error);
-                sp->assembled[(s->y * sp->size_x) + s->x] = code;
-            }
+        for ( ; k < nbands && bands[k].sp == sp; ++k) {
+            wait_band(&bands[k]);
+            if (bands[k].err_row != NULL)
+              fatal_error(bands[k].err_row, bands[k].err_pos, "%s", bands[k].err_msg);
         }
 
         if (sp->fillvalue == -1u)
@@ -324,46 +574,61 @@ puts("Dumping ELF binary...");
           e_flags = PF_FUNG_FILLVALUE | sp->fillvalue;
         e_flags |= sp->flags;
 
+        /* felfout takes over the cells, and frees them. */
         FungELF_addtext(e_origin, e_size, e_flags, sp->assembled);
+        sp->assembled = NULL;
+        ahead -= sp->size_x * sp->size_y;
+    }
+    stop_workers();
+    if (cache_lookups != 0) {
+        progress("  Assembled %lu cells, %lu (%.1f%%) from the cache\n",
+            cache_lookups, cache_hits, 100.0 * cache_hits / cache_lookups);
     }
 
-    FungELF_writefile(out);
-    FungELF_done();
+    if (out != NULL) {
+        if (FungELF_writefile(out) != 0)
+          fatal_error(NULL, -1, "The ELF file could not be written.");
+        streamfp = NULL;
+        FungELF_done();
+    }
 
+    if (mapfp != NULL)
+      write_symbol_map(mapfp);
     kill_all_globals();
-    return 0;
 }
 
 
-/* Free the global lists. */
-static void kill_all_globals(void)
+/* Write the value of each label; that is, each .EQU that was defined
+ * as a vector in terms of "." in a located section. (".EQU Foo ..y"
+ * is a coordinate, not a location.) simfunge -m reads this back,
+ * to name the hot spots in a profile. One symbol per line:
+ * "xxx yyy name", with the coordinates in octal. */
+static void write_symbol_map(FILE *fp)
 {
-    while (secthead != NULL) {
-        struct Section *sp = secthead->next;
-        kill_Section(secthead);
-        free(secthead);
-        secthead = sp;
-    }
-    while (global_equs != NULL) {
-        struct EquDef *ep = global_equs->next;
-        kill_Equ(global_equs);
-        free(global_equs);
-        global_equs = ep;
-    }
-    while (global_macros != NULL) {
-        struct MacroDef *mp = global_macros->next;
-        free(global_macros->text);
-        free(global_macros->replacement);
-        free(global_macros);
-        global_macros = mp;
+    struct EquDef *ep;
+    for (ep = global_equs; ep != NULL; ep = ep->next) {
+        unsigned int value;
+        if (!ep->is_location) continue;
+        value = true_value(ep->text, strlen(ep->text));
+        if (value == -1u || !(value & IS_VECTOR)) continue;
+        fprintf(fp, "%03o %03o %s\n", value & 0777, (value >> 9) & 0777, ep->text);
     }
 }
 
+/* Free the global lists, and everything else in the arena. */
+static void kill_all_globals(void)
+{
+    secthead = NULL;
+    global_equs = NULL;
+    global_macros = NULL;
+    kill_symbols();
+    arena_release(&arena);
+}
+
 
 static struct Section *new_Section(struct Section *next)
 {
-    struct Section *sp = malloc(sizeof *sp);
-    assert(sp != NULL);
+    struct Section *sp = arena_alloc(&arena, sizeof *sp);
     sp->rows = NULL;
     sp->rowslen = sp->rowscap = 0;
     sp->local_macros = NULL;
@@ -381,60 +646,36 @@ static struct Section *new_Section(struct Section *next)
     return sp;
 }
 
-static void kill_Section(struct Section *sp)
-{
-    /* Do not free(sp); just delete all its members. */
-    int i, j;
-    assert(sp != NULL);
-    while (sp->local_macros != NULL) {
-        struct MacroDef *mp = sp->local_macros->next;
-        free(sp->local_macros->text);
-        free(sp->local_macros->replacement);
-        free(sp->local_macros);
-        sp->local_macros = mp;
-    }
-    for (i=0; i < sp->rowslen; ++i) {
-        struct Row *r = &sp->rows[i];
-        for (j=0; j < r->len; ++j) {
-            free(r->s[j].text);
-        }
-        free(r->s);
-    }
-    free(sp->rows);
-    if (sp->assembled != NULL)
-      free(sp->assembled);
-}
-
-
 static void add_row(struct Section *sp, const struct Row *r)
 {
     if (sp->rowslen >= sp->rowscap) {
-        sp->rowscap = sp->rowslen + 5;
-        sp->rows = realloc(sp->rows, sp->rowscap * sizeof *sp->rows);
-        assert(sp->rows != NULL);
+        int newcap = 2*sp->rowscap + 5;
+        sp->rows = arena_grow(&arena, sp->rows,
+            sp->rowscap * sizeof *sp->rows, newcap * sizeof *sp->rows);
+        sp->rowscap = newcap;
     }
     assert(sp->rowslen < sp->rowscap);
     sp->rows[sp->rowslen++] = *r;
 }
 
-static int add_macro(struct MacroDef **mlist, const char *text, int textlen,
+static int add_macro(struct Section *sp, const char *text, int textlen,
                       const char *replacement)
 {
-    struct MacroDef *mp = find_macro(*mlist, text, textlen);
-    if (mp != NULL)
-      return -1;
-    mp = malloc(sizeof *mp);
-    assert(mp != NULL);
-    mp->text = malloc(textlen+1);
-    assert(mp->text != NULL);
-    memcpy(mp->text, text, textlen);
-    mp->text[textlen] = '\0';
-    mp->replacement = malloc(strlen(replacement)+1);
-    assert(mp->replacement != NULL);
-    strcpy(mp->replacement, replacement);
+    struct Symbol *sym = find_symbol(text, textlen, 1);
+    struct MacroDef *mp;
+    for (mp = sym->macros; mp != NULL; mp = mp->same_name) {
+        if (mp->scope == sp)
+          return -1;
+    }
+    mp = arena_alloc(&arena, sizeof *mp);
+    mp->text = sym->name;
+    mp->replacement = arena_strdup(&arena, replacement);
     mp->unusable = 0;
-    mp->next = *mlist;
-    *mlist = mp;
+    mp->scope = sp;
+    mp->same_name = sym->macros;
+    sym->macros = mp;
+    mp->next = sp->local_macros;
+    sp->local_macros = mp;
     return 0;
 }
 
@@ -498,8 +739,7 @@ static struct Row *split_strings(const char *line)
       return NULL;
 
     ret.len = rlen;
-    ret.s = malloc(rlen * sizeof *ret.s);
-    assert(ret.s != NULL);
+    ret.s = arena_alloc(&arena, rlen * sizeof *ret.s);
 
     /* Now, fill in the array elements. */
     in_string = 0;
@@ -525,8 +765,7 @@ static struct Row *split_strings(const char *line)
             int len;
             assert(ridx < rlen);
             ret.s[ridx].start = realstart;
-            ret.s[ridx].text = malloc(realpos - realstart + 2);
-            assert(ret.s[ridx].text != NULL);
+            ret.s[ridx].text = arena_alloc(&arena, realpos - realstart + 2);
             len = detab_selection(ret.s[ridx].text, line+start, i-start, realstart);
             ret.s[ridx].len = len;
             ret.s[ridx].comment = 0;
@@ -685,8 +924,9 @@ static void resolve_grid(struct Section *sp)
         }
     }
 
-    is_x = calloc(width_in_columns+1, sizeof *is_x);
-    assert(is_x != NULL);
+    /* From the arena, so that a fatal error below leaks nothing. */
+    is_x = arena_alloc(&arena, (width_in_columns+1) * sizeof *is_x);
+    memset(is_x, 0, (width_in_columns+1) * sizeof *is_x);
 
     /* Figure out which columns correspond to Funge-space x values */
     for (i=0; i < sp->rowslen; ++i) {
@@ -733,8 +973,6 @@ static void resolve_grid(struct Section *sp)
             }
         }
     }
-
-    free(is_x);
 }
 
 
@@ -761,7 +999,7 @@ static void extract_directives(struct Section *sp)
                 }
                 while (*replacement == ' ')
                   ++replacement;
-                if (add_macro(&sp->local_macros, ip, len, replacement) != 0) {
+                if (add_macro(sp, ip, len, replacement) != 0) {
                     fatal_error(&sp->rows[i], s->start + (ip - s->text),
                         "Redefinition of macro %.*s", len, ip);
                 }
@@ -781,16 +1019,15 @@ static void extract_directives(struct Section *sp)
                 }
                 while (*replacement == ' ')
                   ++replacement;
+                if (find_equ(ip, len) != NULL) {
+                    fatal_error(&sp->rows[i], s->start + (ip - s->text),
+                        "Redefinition of symbol %.*s", len, ip);
+                }
                 ep = new_Equ(ip, len, replacement, global_equs);
                 /* do not replace_dot() yet, because we don't know the .ORG */
                 ep->sp = sp;
                 ep->s = s;
-                if (find_equ(ep->text, len) != NULL) {
-                    fatal_error(&sp->rows[i], s->start + (ip - s->text),
-                        "Redefinition of symbol %.*s", len, ip);
-                } else {
-                    global_equs = ep;
-                }
+                global_equs = ep;
             } else if (!strncmp(s->text, ".ENTRY", 6) && isspace(s->text[6])) {
                 /* do nothing; it will be handled later, because we can't
                  * parse it until we know all the .EQU symbols' values */
@@ -888,10 +1125,11 @@ static void decide_global(struct Section *sp)
 
     /* Okay, copy its local stuff over to the global stuff. */
     while (sp->local_macros != NULL) {
-        struct MacroDef *mp = find_macro(global_macros,
+        struct MacroDef *mp = find_macro(NULL,
             sp->local_macros->text, strlen(sp->local_macros->text));
         if (mp != NULL)
           fatal_error(NULL, -1, "Redefinition of global macro \"%s\"", mp->text);
+        sp->local_macros->scope = NULL;
         mp = sp->local_macros->next;
         sp->local_macros->next = global_macros;
         global_macros = sp->local_macros;
@@ -928,20 +1166,18 @@ static void resolve_macros(struct Section *sp, char **text)
         /* If this identifier is a macro, expand it. */
         struct MacroDef *mp = NULL;
         if (sp != NULL)
-          mp = find_macro(sp->local_macros, ip, len);
+          mp = find_macro(sp, ip, len);
         if (mp == NULL)
-          mp = find_macro(global_macros, ip, len);
+          mp = find_macro(NULL, ip, len);
         if (mp != NULL) {
             int replen;
             if (mp->unusable)
               fatal_error(NULL, -1, "Use of infinitely recursive macro %s", mp->text);
             replen = strlen(mp->replacement);
             if (replen > len) {
-                char *newtext = malloc(strlen(*text) + replen-len + 1);
-                assert(newtext != NULL);
-                strcpy(newtext, *text);
+                size_t oldlen = strlen(*text) + 1;
+                char *newtext = arena_grow(&arena, *text, oldlen, oldlen + replen-len);
                 ip = newtext + (ip - *text);
-                free(*text);
                 *text = newtext;
             }
             if (replen != len)
@@ -953,18 +1189,20 @@ static void resolve_macros(struct Section *sp, char **text)
     }
 }
 
-static void replace_dot(char **ptext, int x, int y)
+/* Returns the number of dots replaced. */
+static int replace_dot(char **ptext, int x, int y)
 {
     char *text = *ptext;
     char *ip = text;
     int len;
+    int count = 0;
     const char *notnow = NULL;
 
     /* Test whether we need to do this, but the speedy
      * test is overly conservative; we might have
      * ".EQU DOT '.'", which shouldn't be replaced. */
     if (strchr(ip, '.') == NULL)
-      return;
+      return 0;
 
     while ((ip = find_token(ip, &len, NULL)) != NULL) {
         if (ip == notnow) {
@@ -975,8 +1213,7 @@ static void replace_dot(char **ptext, int x, int y)
             notnow = ip+len;
         } else if (len == 1 && *ip == '.') {
             /* Replace this dot with (x,y). */
-            char *newtext = malloc((ip-text) + 8 + strlen(ip) + 1);
-            assert(newtext != NULL);
+            char *newtext = arena_alloc(&arena, (ip-text) + 8 + strlen(ip) + 1);
             if (ip > text)
               memcpy(newtext, text, ip-text);
             sprintf(newtext+(ip-text), "(%03o,%03o)",
@@ -984,84 +1221,175 @@ static void replace_dot(char **ptext, int x, int y)
             strcpy(newtext+(ip-text)+9, ip+1);
             ip = newtext+(ip-text)+9;
             assert(ip[-1] == ')');
-            free(text);
             *ptext = text = newtext;
             notnow = ip+1;
+            count += 1;
         }
         ip += len;
     }
+    return count;
 }
 
 
+/* The new EQU hides any older one of the same name. */
 static struct EquDef *new_Equ(const char *text, int len,
         const char *replacement, struct EquDef *next)
 {
-    struct EquDef *ep = malloc(sizeof *ep);
-    assert(ep != NULL);
-    ep->text = malloc(len+1);
-    assert(ep->text != NULL);
-    memcpy(ep->text, text, len);
-    ep->text[len] = '\0';
-    ep->replacement = malloc(strlen(replacement)+1);
-    assert(ep->replacement != NULL);
-    strcpy(ep->replacement, replacement);
+    struct Symbol *sym = find_symbol(text, len, 1);
+    struct EquDef *ep = arena_alloc(&arena, sizeof *ep);
+    ep->text = sym->name;
+    sym->equ = ep;
+    ep->replacement = arena_strdup(&arena, replacement);
     ep->sp = NULL;
     ep->s = NULL;
     ep->unusable = 0;
+    ep->is_location = 0;
+    ep->error = NULL;
     ep->value = -1u;
     ep->next = next;
     return ep;
 }
 
-static void kill_Equ(struct EquDef *ep)
-{
-    assert(ep != NULL);
-    assert(ep->text != NULL);
-    assert(ep->replacement != NULL);
-    free(ep->text);
-    free(ep->replacement);
-}
-
-/* Resolve and return the "true value" of an EQU symbol. */
+/* Resolve and return the "true value" of an EQU symbol. EQUs are
+ * resolved lazily, as the directives use them, until resolve_equs()
+ * resolves the rest. The error it finds then, in an EQU or in one
+ * that it uses, is kept in 'error', and 'equ_error' is set to it
+ * whenever the EQU is used, so that the first cell to use it reports
+ * it, just as it would have had that cell resolved the EQU. */
 unsigned int true_value(const char *equname, int len)
 {
     struct EquDef *ep = find_equ(equname, len);
     if (ep == NULL) return -1u;
-    if (ep->unusable) return -1u;
-    if (ep->value == -1u) {
+    if (ep->value == -1u && !ep->unusable) {
+        const char *outer = equ_error;
         int len;
+        equ_error = NULL;
         ep->unusable = 1;
         ep->value = eval_scalar(ep->replacement, &len);
         if (ep->value != -1u && ep->replacement[len] != '\0') {
-            fatal_error(NULL, -1, "Unexpected text after .EQU directive"
-                " defining symbol \"%s\": \"%s\"", ep->text,
-                ep->replacement+len);
+            static const char fmt[] = "Unexpected text after .EQU directive"
+                " defining symbol \"%s\": \"%s\"";
+            char *msg;
+            if (!resolving_equs)
+              fatal_error(NULL, -1, fmt, ep->text, ep->replacement+len);
+            msg = arena_alloc(&arena, sizeof fmt + strlen(ep->text) +
+                                      strlen(ep->replacement+len));
+            sprintf(msg, fmt, ep->text, ep->replacement+len);
+            ep->error = msg;
+            ep->value = -1u;
+        } else if (equ_error != NULL) {
+            ep->error = equ_error;
+            ep->value = -1u;
+        } else if (ep->value != -1u) {
+            ep->unusable = 0;
+        } else if (resolving_equs && fungasm_error != NULL) {
+            ep->error = arena_strdup(&arena, fungasm_error);
         }
-        if (ep->value != -1u)
-          ep->unusable = 0;
+        equ_error = outer;
     }
+    if (ep->error != NULL && equ_error == NULL)
+      equ_error = ep->error;
     return ep->value;
 }
 
-static struct EquDef *find_equ(const char *text, int len)
+/* Resolve every EQU that's left, before the cells are assembled,
+ * so that the worker threads never have to. */
+static void resolve_equs(void)
 {
     struct EquDef *ep;
-    for (ep = global_equs; ep != NULL; ep = ep->next) {
-        if (!strncmp(ep->text, text, len) && ep->text[len] == '\0')
-          return ep;
-    }
-    return NULL;
+    resolving_equs = 1;
+    for (ep = global_equs; ep != NULL; ep = ep->next)
+      true_value(ep->text, strlen(ep->text));
+    resolving_equs = 0;
+}
+
+static struct EquDef *find_equ(const char *text, int len)
+{
+    struct Symbol *sym = find_symbol(text, len, 0);
+    return (sym != NULL)? sym->equ: NULL;
 }
 
-static struct MacroDef *find_macro(struct MacroDef *mlist, const char *text, int len)
+/* Find the macro of this name defined in 'scope' itself. */
+static struct MacroDef *find_macro(const struct Section *scope,
+                                   const char *text, int len)
 {
+    struct Symbol *sym;
+    struct MacroDef *mp;
     if (len <= 0) return NULL;
-    for ( ; mlist != NULL; mlist = mlist->next) {
-        if (strncmp(text, mlist->text, len) == 0)
-          if (mlist->text[len] == '\0')
-            break;
+    sym = find_symbol(text, len, 0);
+    if (sym == NULL) return NULL;
+    for (mp = sym->macros; mp != NULL; mp = mp->same_name) {
+        if (mp->scope == scope)
+          break;
+    }
+    return mp;
+}
+
+
+/* Find the interned name 'text', of length 'len'. If there isn't one,
+ * return NULL, or add it to the table if 'create' is set. */
+static struct Symbol *find_symbol(const char *text, int len, int create)
+{
+    unsigned int h = hash_name(text, len);
+    struct Symbol *sym;
+    if (symbols != NULL) {
+        for (sym = symbols[h & symbols_mask]; sym != NULL; sym = sym->next) {
+            if (sym->hash == h && !strncmp(sym->name, text, len) &&
+                sym->name[len] == '\0')
+              return sym;
+        }
     }
-    return mlist;
+    if (!create)
+      return NULL;
+    if (nsymbols >= symbols_mask)
+      grow_symbols();
+    sym = arena_alloc(&arena, sizeof *sym);
+    sym->name = arena_strndup(&arena, text, len);
+    sym->hash = h;
+    sym->equ = NULL;
+    sym->macros = NULL;
+    sym->next = symbols[h & symbols_mask];
+    symbols[h & symbols_mask] = sym;
+    nsymbols += 1;
+    return sym;
+}
+
+/* FNV-1a. */
+static unsigned int hash_name(const char *text, int len)
+{
+    unsigned int h = 2166136261u;
+    int i;
+    for (i=0; i < len; ++i)
+      h = (h ^ (unsigned char)text[i]) * 16777619u;
+    return h;
+}
+
+/* Double the number of buckets, keeping about one symbol per bucket. */
+static void grow_symbols(void)
+{
+    unsigned int newmask = (symbols == NULL)? 255: 2*symbols_mask + 1;
+    struct Symbol **newsyms = calloc(newmask+1, sizeof *newsyms);
+    unsigned int i;
+    assert(newsyms != NULL);
+    for (i=0; symbols != NULL && i <= symbols_mask; ++i) {
+        while (symbols[i] != NULL) {
+            struct Symbol *sym = symbols[i];
+            symbols[i] = sym->next;
+            sym->next = newsyms[sym->hash & newmask];
+            newsyms[sym->hash & newmask] = sym;
+        }
+    }
+    free(symbols);
+    symbols = newsyms;
+    symbols_mask = newmask;
+}
+
+/* The symbols themselves are in the arena. */
+static void kill_symbols(void)
+{
+    free(symbols);
+    symbols = NULL;
+    nsymbols = symbols_mask = 0;
 }
 
 
@@ -1146,13 +1474,6 @@ static void trim_section(struct Section *sp)
         assert(miny < sp->rowslen);
         assert(miny < sp->size_y);
         assert(sp->org_y != -1u);
-        for (i=0; i < miny; ++i) {
-            struct Row *r = &sp->rows[i];
-            for (j=0; j < r->len; ++j) {
-                free(r->s[j].text);
-            }
-            free(r->s);
-        }
         sp->rowslen -= miny;
         memmove(&sp->rows[0], &sp->rows[miny], sp->rowslen * sizeof *sp->rows);
         sp->size_y -= miny;
@@ -1169,7 +1490,6 @@ static void trim_section(struct Section *sp)
         for (i=0; i < sp->rowslen; ++i) {
             struct Row *r = &sp->rows[i];
             while ((r->len != 0) && (r->s[0].x < minx)) {
-                free(r->s[0].text);
                 r->len -= 1;
                 memmove(&r->s[0], &r->s[1], r->len * sizeof r->s[0]);
             }
@@ -1183,6 +1503,232 @@ static void trim_section(struct Section *sp)
 }
 
 
+/* Give the section somewhere to assemble its cells, filled with its
+ * fill value, and replace the dots in its cells. */
+static void prepare_section(struct Section *sp)
+{
+    int i, j;
+    assert(sp->size_x >= 0);
+    assert(sp->size_y >= 0);
+    assert(!sp->size_x == !sp->size_y);
+
+    sp->assembled = malloc(sp->size_x * sp->size_y * sizeof *sp->assembled);
+    assert(sp->assembled != NULL);
+
+    if (sp->fillvalue != -1u) {
+        assert((sp->fillvalue & ~0777777) == 0);
+        for (i=0; i < sp->size_x * sp->size_y; ++i)
+          sp->assembled[i] = sp->fillvalue;
+    } else {
+        memset(sp->assembled, 0xFF,
+            sp->size_x * sp->size_y * sizeof *sp->assembled);
+    }
+
+    for (i=0; i < sp->size_y; ++i) {
+        assert(i < sp->rowslen);
+        for (j=0; j < sp->rows[i].len; ++j) {
+            struct String *s = &sp->rows[i].s[j];
+            assert(s != NULL);
+            if (s->comment) continue;
+            if (s->x >= sp->size_x) break;
+            assert(s->y == i);
+            if (s->text[0] == '.') continue;
+            replace_dot(&s->text, sp->org_x+s->x, sp->org_y+s->y);
+        }
+    }
+}
+
+/* Split the section into bands, starting at 'b', and hand them
+ * to the workers. Returns the number of bands. */
+static int queue_bands(struct Section *sp, struct Band *b)
+{
+    int n = 0;
+    int first;
+    for (first = 0; first < sp->size_y; first += BAND_ROWS) {
+        b[n].sp = sp;
+        b[n].first = first;
+        b[n].last = (first + BAND_ROWS < sp->size_y)? first + BAND_ROWS: sp->size_y;
+        b[n].done = 0;
+        b[n].err_row = NULL;
+        n += 1;
+    }
+    pthread_mutex_lock(&band_lock);
+    nbands_queued += n;
+    pthread_cond_broadcast(&band_changed);
+    pthread_mutex_unlock(&band_lock);
+    return n;
+}
+
+/* With one thread, there are no workers; wait_band() assembles
+ * each band itself. */
+static void start_workers(int nbands)
+{
+    int i;
+
+    bands = malloc((nbands + 1) * sizeof *bands);
+    assert(bands != NULL);
+    nbands_total = nbands;
+    nbands_queued = nbands_taken = 0;
+    cache_lookups = cache_hits = 0;
+
+    if (NumThreads == 0)
+      NumThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (NumThreads > nbands)
+      NumThreads = nbands;
+    if (NumThreads <= 1)
+      return;
+
+    workers = malloc(NumThreads * sizeof *workers);
+    assert(workers != NULL);
+    for (i=0; i < NumThreads; ++i) {
+        if (pthread_create(&workers[i], NULL, band_worker, NULL) != 0)
+          break;
+    }
+    nworkers = i;
+}
+
+static void *band_worker(void *unused)
+{
+    struct CodeCache cache = { NULL, 0, 0, 0, 0 };
+    (void)unused;
+    while (1) {
+        struct Band *b;
+        pthread_mutex_lock(&band_lock);
+        while (nbands_taken == nbands_queued && nbands_taken < nbands_total)
+          pthread_cond_wait(&band_changed, &band_lock);
+        if (nbands_taken == nbands_total) {
+            kill_cache(&cache);
+            pthread_mutex_unlock(&band_lock);
+            return NULL;
+        }
+        b = &bands[nbands_taken++];
+        pthread_mutex_unlock(&band_lock);
+
+        assemble_band(b, &cache);
+
+        pthread_mutex_lock(&band_lock);
+        b->done = 1;
+        pthread_cond_broadcast(&band_changed);
+        pthread_mutex_unlock(&band_lock);
+    }
+}
+
+static void assemble_band(struct Band *b, struct CodeCache *cache)
+{
+    struct Section *sp = b->sp;
+    int i, j;
+    for (i = b->first; i < b->last; ++i) {
+        for (j=0; j < sp->rows[i].len; ++j) {
+            struct String *s = &sp->rows[i].s[j];
+            unsigned int code;
+            if (s->comment) continue;
+            if (s->x >= sp->size_x) break;
+            if (s->text[0] == '.') continue;
+            equ_error = NULL;
+            code = cached_fungasm(cache, s->text);
+            if (equ_error != NULL) {
+                b->err_row = &sp->rows[i];
+                b->err_pos = s->start;
+                b->err_msg = equ_error;
+                return;
+            } else if (code & ~0777777) {
+                b->err_row = &sp->rows[i];
+                b->err_pos = s->start;
+                sprintf(b->err_buf, "%.*s", (int)sizeof b->err_buf - 1, fungasm_error);
+                b->err_msg = b->err_buf;
+                return;
+            }
+            sp->assembled[(s->y * sp->size_x) + s->x] = code;
+        }
+    }
+}
+
+static unsigned int cached_fungasm(struct CodeCache *cache, const char *text)
+{
+    unsigned int hash = hash_name(text, strlen(text));
+    unsigned int i, code;
+
+    cache->lookups += 1;
+    for (i = hash & cache->mask; cache->slots != NULL; i = (i+1) & cache->mask) {
+        const struct CachedCode *cc = &cache->slots[i];
+        if (cc->text == NULL)
+          break;
+        if (cc->hash == hash && !strcmp(cc->text, text)) {
+            cache->hits += 1;
+            return cc->code;
+        }
+    }
+
+    code = fungasm(text);
+    if ((code & ~0777777) || equ_error != NULL)
+      return code;
+    if (2*(cache->count + 1) > cache->mask)
+      grow_cache(cache);
+    for (i = hash & cache->mask; cache->slots[i].text != NULL; i = (i+1) & cache->mask)
+      continue;
+    cache->slots[i].text = text;
+    cache->slots[i].hash = hash;
+    cache->slots[i].code = code;
+    cache->count += 1;
+    return code;
+}
+
+/* Double the number of slots, keeping the cache at most half full. */
+static void grow_cache(struct CodeCache *cache)
+{
+    unsigned int newmask = (cache->slots == NULL)? 255: 2*cache->mask + 1;
+    struct CachedCode *newslots = calloc(newmask+1, sizeof *newslots);
+    unsigned int i, k;
+    assert(newslots != NULL);
+    for (i=0; cache->slots != NULL && i <= cache->mask; ++i) {
+        if (cache->slots[i].text == NULL) continue;
+        for (k = cache->slots[i].hash & newmask; newslots[k].text != NULL; k = (k+1) & newmask)
+          continue;
+        newslots[k] = cache->slots[i];
+    }
+    free(cache->slots);
+    cache->slots = newslots;
+    cache->mask = newmask;
+}
+
+/* The texts are the cells' own, in the arena. A worker's cache is
+ * killed with band_lock held. */
+static void kill_cache(struct CodeCache *cache)
+{
+    cache_lookups += cache->lookups;
+    cache_hits += cache->hits;
+    free(cache->slots);
+    cache->slots = NULL;
+    cache->mask = cache->count = 0;
+    cache->lookups = cache->hits = 0;
+}
+
+static void wait_band(struct Band *b)
+{
+    if (nworkers == 0) {
+        assemble_band(b, &main_cache);
+        return;
+    }
+    pthread_mutex_lock(&band_lock);
+    while (!b->done)
+      pthread_cond_wait(&band_changed, &band_lock);
+    pthread_mutex_unlock(&band_lock);
+}
+
+static void stop_workers(void)
+{
+    int i;
+    for (i=0; i < nworkers; ++i)
+      pthread_join(workers[i], NULL);
+    free(workers);
+    workers = NULL;
+    nworkers = 0;
+    free(bands);
+    bands = NULL;
+    kill_cache(&main_cache);
+}
+
+
 static unsigned int makebgfill(const struct Section *sp)
 {
     unsigned int goodbgfill = 0x424242;  /* LX.V 2,[4^2] */
@@ -1323,6 +1869,20 @@ void fatal_error(const struct Row *r, int pos, const char *msg, ...)
     va_list ap;
     int print_arrow = (pos >= 0);
     va_start(ap, msg);
+    if (fatal_jmp != NULL) {
+        /* There's no source line to print, so say where it was. */
+        if (fatal_msg != NULL) {
+            int n = 0;
+            if (r != NULL && print_arrow)
+              n = snprintf(fatal_msg, fatal_msglen, "line %d, column %d: ", r->line, pos+1);
+            else if (r != NULL)
+              n = snprintf(fatal_msg, fatal_msglen, "line %d: ", r->line);
+            if (n >= 0 && (size_t)n < fatal_msglen)
+              vsnprintf(fatal_msg + n, fatal_msglen - n, msg, ap);
+        }
+        va_end(ap);
+        longjmp(*fatal_jmp, 1);
+    }
     if (r != NULL)
       pos -= print_Row(stdout, r, pos);
     if (print_arrow)
@@ -1331,6 +1891,13 @@ void fatal_error(const struct Row *r, int pos, const char *msg, ...)
     vprintf(msg, ap);
     putchar('\n');
     va_end(ap);
+    /* Leave the output empty, not half written. */
+    if (streamfp != NULL) {
+        fflush(streamfp);
+        if (ftruncate(fileno(streamfp), 0) != 0) {
+            /* it's not a plain file; leave it be */
+        }
+    }
     exit(EXIT_FAILURE);
 }
 
@@ -1338,6 +1905,8 @@ void warning(const struct Row *r, int pos, const char *msg, ...)
 {
     va_list ap;
     int print_arrow = (pos >= 0);
+    if (Quiet)
+      return;
     va_start(ap, msg);
     if (r != NULL)
       pos -= print_Row(stdout, r, pos);
@@ -1350,14 +1919,32 @@ void warning(const struct Row *r, int pos, const char *msg, ...)
     return;
 }
 
+static void progress(const char *fmat, ...)
+{
+    va_list ap;
+    if (Quiet)
+      return;
+    va_start(ap, fmat);
+    vprintf(fmat, ap);
+    va_end(ap);
+}
+
+#ifndef FUNGASM_LIBRARY
 static void dohelp(int man)
 {
-    puts("Usage: fungasm program.asm [output.elf]");
+    puts("Usage: fungasm [-m program.map] [-z] [-j threads] program.asm [output.elf]");
     if (man) {
         puts("");
         puts("  fungasm is the Fungus assembler. It assembles \"program.asm\" into");
         puts("\"program.elf\", or into a filename provided on the command line.");
         puts("For details of the Fungus assembly language, see the HTML manual.");
+        puts("  -m also writes a symbol map, listing the location of each label");
+        puts("(each .EQU defined in terms of \".\"), for use with simfunge -m.");
+        puts("  -z writes text sections run-length coded, where that makes");
+        puts("them smaller; mostly-blank sections shrink the most.");
+        puts("  -j sets the number of threads that assemble cells; by default,");
+        puts("there's one per CPU. The output is the same either way.");
     }
     exit(EXIT_FAILURE);
 }
+#endif
@@ -4,12 +4,17 @@
 
 
 /* Macros are basically like C preprocessor macros: literal text replacement.
- * We have one global macro list, plus one local list for each section. */
+ * We have one global macro list, plus one local list for each section.
+ * Macros are looked up through the symbol table, though; 'scope' is the
+ * section that can see this macro, or NULL for a global macro, and
+ * 'same_name' links all the macros of this name, in every scope. */
 
 struct MacroDef {
     char *text;
     char *replacement;
     struct MacroDef *next;
+    struct Section *scope;
+    struct MacroDef *same_name;
     int unusable;  /* marks mutually recursive or unresolvable EQUs */
 };
 
@@ -32,6 +37,8 @@ struct EquDef {
     unsigned int value;
     struct EquDef *next;
     int unusable;  /* marks mutually recursive or unresolvable EQUs */
+    int is_location;  /* defined in terms of ".", so probably a label */
+    const char *error;  /* for the first cell that uses it to report */
 };
 
 
@@ -53,6 +60,7 @@ struct String {
 struct Row {
     int len;
     struct String *s;  /* dynamically allocated array */
+    int line;  /* where it is in the source, counting from 1 */
 };
 
 struct Section {
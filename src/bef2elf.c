@@ -33,14 +33,16 @@ int main(int argc, const char *argv[])
 #define BW 80
 #define BH 25
 
-static unsigned int ubuffer[BW*BH];
-
 
 static int bef2elf(FILE *in, FILE *out)
 {
+    /* FungELF_addtext() will take this over. */
+    unsigned int *ubuffer = malloc(BW*BH * sizeof *ubuffer);
     int i, j;
     int rc = 0;
 
+    if (ubuffer == NULL)
+      return -1;
     for (i=0; i < BW*BH; ++i)
       ubuffer[i] = ' ';
 
@@ -48,9 +50,9 @@ static int bef2elf(FILE *in, FILE *out)
         char buffer[BW+3];
         if (fgets(buffer, sizeof buffer, in) == NULL)
           break;
-        for (j=0; buffer[j] != '\0'; ++j) {
+        for (j=0; j < BW && buffer[j] != '\0'; ++j) {
             if (32 <= buffer[j])
-              ubuffer[j*BW+i] = buffer[j];
+              ubuffer[i*BW+j] = buffer[j];
             else break;
         }
     }
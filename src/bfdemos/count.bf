@@ -0,0 +1,2 @@
+1>:.:55+,1+:55*`!#v_@
+ ^                <
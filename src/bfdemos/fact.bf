@@ -0,0 +1,2 @@
+5>:1-:v v *_$.@
+ ^    _$>\:^
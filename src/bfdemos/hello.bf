@@ -0,0 +1 @@
+"!dlroW olleH",,,,,,,,,,,,@
@@ -0,0 +1,2 @@
+99*:*9*>1-:v
+       ^   _@
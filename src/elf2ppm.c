@@ -9,6 +9,10 @@
 #define steq(x,y) (!strcmp(x,y))
 
 static void process_one(const char *inname);
+ static int cbsc(int x, int y, unsigned int value);
+ static int cbfr(int sx, int sy, int w, int h, unsigned int value);
+ static int cbcr(int sx, int y, int n, const unsigned int *words);
+  static void set_pixel(unsigned char *px, unsigned int value);
 static void do_error(const char *fmat, ...);
 static void do_help(int man);
 
@@ -84,23 +88,49 @@ int main(int argc, char *argv[])
 }
 
 
+/* Each pair of octal digits of the word becomes one color channel,
+ * so that a word can be read straight off the pixel in hex. */
+static void set_pixel(unsigned char *px, unsigned int value)
+{
+    px[0] = ((value >> 15) & 7) << 4 | ((value >> 12) & 7);
+    px[1] = ((value >> 9) & 7) << 4 | ((value >> 6) & 7);
+    px[2] = ((value >> 3) & 7) << 4 | (value & 7);
+}
+
 static int cbsc(int x, int y, unsigned int value)
 {
-    char buffer[7];
-    unsigned char v0, v1, v2;
-    sprintf(buffer, "%06o", value & 0777777);
-    v0 = (buffer[0]-'0') << 4 | (buffer[1]-'0');
-    v1 = (buffer[2]-'0') << 4 | (buffer[3]-'0');
-    v2 = (buffer[4]-'0') << 4 | (buffer[5]-'0');
-    Im[y*512+x][0] = v0;
-    Im[y*512+x][1] = v1;
-    Im[y*512+x][2] = v2;
+    set_pixel(Im[y*512+x], value);
+    return 0;
+}
+
+static int cbfr(int sx, int sy, int w, int h, unsigned int value)
+{
+    unsigned char px[3];
+    int i, j;
+    set_pixel(px, value);
+    for (j=0; j < h; ++j) {
+        unsigned char (*row)[3] = &Im[((sy+j) & 0777) * 512];
+        for (i=0; i < w; ++i)
+          memcpy(row[(sx+i) & 0777], px, 3);
+    }
+    return 0;
+}
+
+static int cbcr(int sx, int y, int n, const unsigned int *words)
+{
+    unsigned char (*px)[3] = &Im[y*512+sx];
+    int i;
+    for (i=0; i < n; ++i)
+      set_pixel(px[i], words[i]);
     return 0;
 }
 
 
 static void process_one(const char *inname)
 {
+    static const struct FungELF_Callbacks callbacks = {
+        NULL, NULL, cbsc, NULL, cbfr, cbcr, NULL
+    };
     FILE *in;
     int rc;
 
@@ -114,7 +144,7 @@ static void process_one(const char *inname)
 	 * Assume the text stream will be ASCII, not ELF. */
 	rc = FungELF_loadascii(in, NULL, NULL, cbsc, NULL);
     } else {
-	rc = FungELF_load(in, NULL, NULL, cbsc, NULL);
+	rc = FungELF_loadx(in, &callbacks);
     }
     
     if (rc < 0) {
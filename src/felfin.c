@@ -3,6 +3,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "fungelf.h"
 
@@ -11,17 +14,35 @@
 #define ELFDATA2MSB  2
 #define ET_EXEC      2
 #define PT_LOAD      1
+#define EHDR_SIZE    52
+#define PHDR_SIZE    32
 
 static cbns_t CBnewsection = NULL;
 static cbgc_t CBgetcell = NULL;
 static cbsc_t CBsetcell = NULL;
 static cbse_t CBsetentry = NULL;
-
-static int read_ehdr(struct ELFHeader *eh, FILE *fp);
-static int read_phdr(struct PHdr *eh, FILE *fp);
- static void read_int(const unsigned char *bp, void *pval, int len);
-static void load_BSS_section(struct PHdr *phdr, unsigned int gfill);
-static int load_text_section(struct PHdr *phdr, FILE *fp, unsigned int gfill);
+static cbfr_t CBfillrect = NULL;
+static cbcr_t CBcopyrow = NULL;
+static cbmc_t CBmapcols = NULL;
+
+static void set_callbacks(const struct FungELF_Callbacks *cb);
+static int load_elf(FILE *fp);
+ static unsigned char *read_whole(FILE *fp, size_t *size);
+ static int load_image(const unsigned char *image, size_t size, int fd);
+  static void read_ehdr(struct ELFHeader *eh, const unsigned char *bp);
+  static void read_phdr(struct PHdr *eh, const unsigned char *bp);
+   static void read_int(const unsigned char *bp, void *pval, int len);
+  static void load_global_fill(unsigned int gfill);
+  static void load_BSS_section(struct PHdr *phdr, unsigned int gfill);
+  static void load_text_section(struct PHdr *phdr, const unsigned char *image,
+                                const unsigned int *cells);
+  static int load_packed_section(struct PHdr *phdr, const unsigned char *image,
+                                 int apply);
+  static void load_image_section(struct PHdr *phdr, const unsigned char *image,
+                                 int fd, const unsigned int *cells);
+   static void unpack_words(unsigned int *words, const unsigned char *bp, int n);
+static int load_ascii(FILE *fp);
+static void copy_row(int sx, int y, const unsigned int *words, int n);
 
 
 /* Load either an ELF file or a plain ASCII file. */
@@ -35,6 +56,74 @@ int FungELF_load(FILE *fp, cbns_t cbns, cbgc_t cbgc, cbsc_t cbsc, cbse_t cbse)
     return rc;
 }
 
+int FungELF_loadx(FILE *fp, const struct FungELF_Callbacks *cb)
+{
+    int rc = FungELF_loadelfx(fp, cb);
+    if (rc < 0) {
+	rewind(fp);
+	rc = load_ascii(fp);
+    }
+    return rc;
+}
+
+int FungELF_loadelfx(FILE *fp, const struct FungELF_Callbacks *cb)
+{
+    set_callbacks(cb);
+    return load_elf(fp);
+}
+
+/* Load a program straight from memory, as the assembler library
+ * returns it. There's nothing to parse, so only the shape of each
+ * native image section is checked. */
+int FungELF_loadimage(const struct FungELF_Image *img,
+        const struct FungELF_Callbacks *cb)
+{
+    unsigned int gfill = -1u;
+    int i;
+
+    for (i=0; i < img->nsections; ++i) {
+        const struct FungELF_Section *s = &img->sections[i];
+        if ((s->flags & PF_FUNG_IMAGE) &&
+            (s->cells == NULL || s->size > 512 - (s->origin & 0777)))
+          return -4;
+    }
+
+    set_callbacks(cb);
+    if (img->fillvalue != -1u) {
+        gfill = img->fillvalue & 0777777;
+        load_global_fill(gfill);
+    }
+    for (i=0; i < img->nsections; ++i) {
+        const struct FungELF_Section *s = &img->sections[i];
+        struct PHdr ph;
+        memset(&ph, 0, sizeof ph);
+        ph.p_type = PT_LOAD;
+        ph.p_vaddr = ph.p_paddr = s->origin;
+        ph.p_memsz = s->size;
+        ph.p_flags = s->flags;
+        if (s->flags & PF_FUNG_IMAGE)
+          load_image_section(&ph, NULL, -1, s->cells);
+        else if (s->cells == NULL)
+          load_BSS_section(&ph, gfill);
+        else
+          load_text_section(&ph, NULL, s->cells);
+    }
+    if (CBsetentry != NULL)
+      CBsetentry(img->entry & 0777, (img->entry >> 9) & 0777);
+    return img->nsections;
+}
+
+static void set_callbacks(const struct FungELF_Callbacks *cb)
+{
+    CBnewsection = cb->newsection;
+    CBgetcell = cb->getcell;
+    CBsetcell = cb->setcell;
+    CBsetentry = cb->setentry;
+    CBfillrect = cb->fillrect;
+    CBcopyrow = cb->copyrow;
+    CBmapcols = cb->mapcols;
+}
+
 
 const char *FungELF_strerror(int rc)
 {
@@ -56,16 +145,26 @@ const char *FungELF_strerror(int rc)
  */
 int FungELF_loadascii(FILE *fp, cbns_t cbns, cbgc_t cbgc, cbsc_t cbsc, cbse_t cbse)
 {
-    int x=0, y=0;
-
     CBnewsection = cbns;
     CBgetcell = cbgc;
     CBsetcell = cbsc;
     CBsetentry = cbse;
+    CBfillrect = NULL;
+    CBcopyrow = NULL;
+    CBmapcols = NULL;
+    return load_ascii(fp);
+}
+
+static int load_ascii(FILE *fp)
+{
+    static unsigned int row[512];
+    int x=0, y=0;
 
     while (1) {
 	int k = getc(fp);
 	if (k == EOF) break;
+	if ((k == '\r' || k == '\n') && CBcopyrow != NULL)
+	  copy_row(0, y, row, x);
 	if (k == '\r') {
 	    y += 1;
 	    if (y == 512)
@@ -84,10 +183,15 @@ int FungELF_loadascii(FILE *fp, cbns_t cbns, cbgc_t cbgc, cbsc_t cbsc, cbse_t cb
 	assert(0 <= x);
 	assert(0 <= y && y < 512);
 	if (x < 512) {
-	    CBsetcell(x, y, k);
+	    if (CBcopyrow != NULL)
+	      row[x] = k;
+	    else
+	      CBsetcell(x, y, k);
 	    ++x;
 	}
     }
+    if (CBcopyrow != NULL && y < 512)
+      copy_row(0, y, row, x);
 
     return 1;
 }
@@ -96,17 +200,76 @@ int FungELF_loadascii(FILE *fp, cbns_t cbns, cbgc_t cbgc, cbsc_t cbsc, cbse_t cb
  */
 int FungELF_loadelf(FILE *fp, cbns_t cbns, cbgc_t cbgc, cbsc_t cbsc, cbse_t cbse)
 {
-    struct ELFHeader ehdr;
-    unsigned int gfill = -1u;
-    int i;
-
     CBnewsection = cbns;
     CBgetcell = cbgc;
     CBsetcell = cbsc;
     CBsetentry = cbse;
+    CBfillrect = NULL;
+    CBcopyrow = NULL;
+    CBmapcols = NULL;
+    return load_elf(fp);
+}
 
-    if (read_ehdr(&ehdr, fp) != sizeof ehdr)
+/* Map the whole file into memory if we can, and read it into a buffer
+ * if we can't (say, if it's a pipe). Either way, the headers and text
+ * sections are then read straight out of the image, with no seeking.
+ * Assumes 'fp' is at the start of the file. */
+static int load_elf(FILE *fp)
+{
+    struct stat st;
+    unsigned char *image = NULL;
+    size_t size = 0;
+    int mapped = 0;
+    int rc;
+
+    if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        size = st.st_size;
+        image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+        if (image == MAP_FAILED)
+          image = NULL;
+        else
+          mapped = 1;
+    }
+    if (image == NULL) {
+        image = read_whole(fp, &size);
+        if (image == NULL)
+          return -1;
+    }
+    rc = load_image(image, size, mapped? fileno(fp): -1);
+    if (mapped)
+      munmap(image, size);
+    else
+      free(image);
+    return rc;
+}
+
+static unsigned char *read_whole(FILE *fp, size_t *size)
+{
+    size_t cap = 65536, len = 0;
+    unsigned char *buf = malloc(cap);
+    while (buf != NULL) {
+        size_t rc = fread(buf+len, 1, cap-len, fp);
+        len += rc;
+        if (len < cap) break;
+        buf = realloc(buf, cap *= 2);
+    }
+    *size = len;
+    return buf;
+}
+
+/* Every header is checked, and every text section checked to lie
+ * within the file, before anything is loaded; a bad file leaves
+ * memory as it was. */
+static int load_image(const unsigned char *image, size_t size, int fd)
+{
+    struct ELFHeader ehdr;
+    struct PHdr *phdrs;
+    unsigned int gfill = -1u;
+    int i;
+
+    if (size < EHDR_SIZE)
       return -1;
+    read_ehdr(&ehdr, image);
     if (ehdr.e_ident[0] != 0x7F) return -2;
     if (ehdr.e_ident[1] != 'E') return -2;
     if (ehdr.e_ident[2] != 'L') return -2;
@@ -118,32 +281,66 @@ int FungELF_loadelf(FILE *fp, cbns_t cbns, cbgc_t cbgc, cbsc_t cbsc, cbse_t cbse
     if (ehdr.e_ehsize < 42) return -2;
     if (ehdr.e_phentsize < 28) return -2;
 
+    phdrs = malloc((ehdr.e_phnum + 1) * sizeof *phdrs);
+    if (phdrs == NULL)
+      return -3;
+    for (i=0; i < ehdr.e_phnum; ++i) {
+        struct PHdr *ph = &phdrs[i];
+        size_t off = ehdr.e_phoff + (size_t)i * ehdr.e_phentsize;
+        if (ehdr.e_phentsize != PHDR_SIZE || off + PHDR_SIZE > size) {
+            free(phdrs);
+            return -3;
+        }
+        read_phdr(ph, image + off);
+        if (ph->p_type != PT_LOAD) {
+            free(phdrs);
+            return -3;
+        }
+        if (ph->p_flags & PF_FUNG_IMAGE) {
+            size_t ncols = ph->p_memsz;
+            if (ncols > 512 - (ph->p_vaddr & 0777) ||
+                ph->p_filesz != 4*512*ncols ||
+                ph->p_offset % FUNG_IMAGE_ALIGN != 0 ||
+                ph->p_offset > size || ph->p_filesz > size - ph->p_offset) {
+                free(phdrs);
+                return -4;
+            }
+        } else if (ph->p_flags & PF_FUNG_PACKED) {
+            if (ph->p_offset > size || ph->p_filesz > size - ph->p_offset ||
+                load_packed_section(ph, image, 0) != 0) {
+                free(phdrs);
+                return -4;
+            }
+        } else if (ph->p_filesz != 0) {
+            size_t w = ph->p_memsz & 0777;
+            size_t h = (ph->p_memsz >> 9) & 0777;
+            if (ph->p_offset > size || 3*w*h > size - ph->p_offset) {
+                free(phdrs);
+                return -4;
+            }
+        }
+    }
+
     /* Deal with a global fill value. */
     if (ehdr.e_flags & PF_FUNG_FILLVALUE) {
-        int i, j;
         gfill = ehdr.e_flags & 0777777;
-        if (CBsetcell != NULL)
-          for (i=0; i <= 0777; ++i)
-            for (j=0; j <= 0777; ++j)
-              CBsetcell(i, j, gfill);
+        load_global_fill(gfill);
     }
 
-    /* Read the sections. */
+    /* Load the sections. */
     for (i=0; i < ehdr.e_phnum; ++i) {
-        struct PHdr phdr;
-        if (fseek(fp, ehdr.e_phoff + i*ehdr.e_phentsize, SEEK_SET) != 0)
-          return -3;
-        if (read_phdr(&phdr, fp) != ehdr.e_phentsize)
-          return -3;
-        if (phdr.p_type != PT_LOAD) return -3;
-        if (phdr.p_filesz == 0) {
+        if (phdrs[i].p_flags & PF_FUNG_IMAGE) {
+            load_image_section(&phdrs[i], image, fd, NULL);
+        } else if (phdrs[i].p_filesz == 0) {
             /* it's a BSS section */
-            load_BSS_section(&phdr, gfill);
+            load_BSS_section(&phdrs[i], gfill);
+        } else if (phdrs[i].p_flags & PF_FUNG_PACKED) {
+            load_packed_section(&phdrs[i], image, 1);
         } else {
-            if (load_text_section(&phdr, fp, gfill) != 0)
-              return -4;
+            load_text_section(&phdrs[i], image, NULL);
         }
     }
+    free(phdrs);
 
     /* Set PC to the entry point, and DeltaPC to zero.
      * The first instruction of the program had better
@@ -155,6 +352,17 @@ int FungELF_loadelf(FILE *fp, cbns_t cbns, cbgc_t cbgc, cbsc_t cbsc, cbse_t cbse
     return ehdr.e_phnum;
 }
 
+static void load_global_fill(unsigned int gfill)
+{
+    int i, j;
+    if (CBfillrect != NULL)
+      CBfillrect(0, 0, 01000, 01000, gfill);
+    else if (CBsetcell != NULL)
+      for (i=0; i <= 0777; ++i)
+        for (j=0; j <= 0777; ++j)
+          CBsetcell(i, j, gfill);
+}
+
 static void load_BSS_section(struct PHdr *phdr, unsigned int gfill)
 {
     int fillvalue = phdr->p_flags & 0777777;
@@ -173,7 +381,9 @@ static void load_BSS_section(struct PHdr *phdr, unsigned int gfill)
         return;
     }
 
-    if (CBsetcell != NULL) {
+    if (CBfillrect != NULL) {
+        CBfillrect(startx, starty, w, h, fillvalue);
+    } else if (CBsetcell != NULL) {
         for (j=0; j < h; ++j) {
             for (i=0; i < w; ++i) {
                   int cx = (startx+i) & 0777;
@@ -184,7 +394,10 @@ static void load_BSS_section(struct PHdr *phdr, unsigned int gfill)
     }
 }
 
-static int load_text_section(struct PHdr *phdr, FILE *fp, unsigned int gfill)
+/* The rows come from 'cells', if it isn't NULL, rather than from
+ * the file. */
+static void load_text_section(struct PHdr *phdr, const unsigned char *image,
+                              const unsigned int *cells)
 {
     unsigned int myfill = (phdr->p_flags & PF_FUNG_FILLVALUE) ?
                             (phdr->p_flags & 0777777) : -1u;
@@ -194,31 +407,167 @@ static int load_text_section(struct PHdr *phdr, FILE *fp, unsigned int gfill)
     int starty = (phdr->p_vaddr >> 9) & 0777;
     int w = phdr->p_memsz & 0777;
     int h = (phdr->p_memsz >> 9) & 0777;
-    static unsigned char buffer[512*3];
+    static unsigned int rowbuf[512];
 
     if (CBnewsection != NULL)
       CBnewsection(startx, starty, w, h, 1);
 
-    if (fseek(fp, phdr->p_offset, SEEK_SET) != 0)
-      return -1;
-
     for (j=0; j < h; ++j) {
-        if ((int)fread(buffer, 1, 3*w, fp) != 3*w)
-          return -1;
-        if (CBsetcell != NULL) {
+        const unsigned int *words = rowbuf;
+        if (cells != NULL)
+          words = cells + j*w;
+        else
+          unpack_words(rowbuf, image + phdr->p_offset + 3*j*w, w);
+        if (CBcopyrow != NULL) {
+            int run = 0;
+            if (nevermyfill) {
+                /* Transparent cells split the row into runs. */
+                for (i=0; i < w; ++i) {
+                    if (words[i] != myfill) continue;
+                    copy_row(startx+run, starty+j, words+run, i-run);
+                    run = i+1;
+                }
+            }
+            copy_row(startx+run, starty+j, words+run, w-run);
+        } else if (CBsetcell != NULL) {
             for (i=0; i < w; ++i) {
                 unsigned int cx = (startx+i) & 0777;
                 unsigned int cy = (starty+j) & 0777;
-                unsigned int WoRd = buffer[3*i] & 3;
-                WoRd = (WoRd << 8) | buffer[3*i+1];
-                WoRd = (WoRd << 8) | buffer[3*i+2];
-                if (!(nevermyfill && WoRd == myfill))
-                  CBsetcell(cx, cy, WoRd);
+                if (!(nevermyfill && words[i] == myfill))
+                  CBsetcell(cx, cy, words[i]);
+            }
+        }
+    }
+}
+
+/* Decode a run-length coded text section. With 'apply' zero, this
+ * only checks that the runs fit the section and the file exactly,
+ * and returns -1 if they don't. Repeat runs become fills. */
+static int load_packed_section(struct PHdr *phdr, const unsigned char *image,
+                               int apply)
+{
+    const unsigned char *bp = image + phdr->p_offset;
+    const unsigned char *end = bp + phdr->p_filesz;
+    int startx = phdr->p_vaddr & 0777;
+    int starty = (phdr->p_vaddr >> 9) & 0777;
+    int w = phdr->p_memsz & 0777;
+    int h = (phdr->p_memsz >> 9) & 0777;
+    static unsigned int words[512];
+    int i, j;
+
+    if (apply && CBnewsection != NULL)
+      CBnewsection(startx, starty, w, h, 1);
+
+    for (j=0; j < h; ++j) {
+        int x = 0;
+        while (x < w) {
+            int kind, count;
+            if (end - bp < 2) return -1;
+            kind = bp[0] >> 6;
+            count = (bp[0] & 077) << 8 | bp[1];
+            bp += 2;
+            if (count == 0 || count > w - x) return -1;
+            if (kind == FUNG_RUN_LITERAL || kind == FUNG_RUN_REPEAT) {
+                int nbytes = (kind == FUNG_RUN_LITERAL)? 3*count: 3;
+                if (end - bp < nbytes) return -1;
+                if (apply && kind == FUNG_RUN_REPEAT && CBfillrect != NULL) {
+                    unpack_words(words, bp, 1);
+                    CBfillrect((startx+x) & 0777, (starty+j) & 0777,
+                               count, 1, words[0]);
+                } else if (apply) {
+                    if (kind == FUNG_RUN_LITERAL) {
+                        unpack_words(words, bp, count);
+                    } else {
+                        unpack_words(words, bp, 1);
+                        for (i=1; i < count; ++i)
+                          words[i] = words[0];
+                    }
+                    if (CBcopyrow != NULL) {
+                        copy_row(startx+x, starty+j, words, count);
+                    } else if (CBsetcell != NULL) {
+                        for (i=0; i < count; ++i)
+                          CBsetcell((startx+x+i) & 0777, (starty+j) & 0777, words[i]);
+                    }
+                }
+                bp += nbytes;
+            } else if (kind != FUNG_RUN_SKIP) {
+                return -1;
             }
+            x += count;
         }
     }
+    return (bp == end)? 0: -1;
+}
+
+/* A native image can be handed over as it is, if the host is
+ * little-endian; otherwise, or if the loader won't take it whole,
+ * it's transposed into rows. If 'cells' isn't NULL, it holds the
+ * columns already, in the host's byte order, and there is no file. */
+static void load_image_section(struct PHdr *phdr, const unsigned char *image,
+                               int fd, const unsigned int *cells)
+{
+    static const unsigned int one = 1;
+    const unsigned char *bp = (image != NULL)? image + phdr->p_offset: NULL;
+    int startx = phdr->p_vaddr & 0777;
+    int ncols = phdr->p_memsz;
+    static unsigned int words[512];
+    int i, j;
 
-    return 0;
+    if (CBnewsection != NULL)
+      CBnewsection(startx, 0, ncols, 512, 1);
+
+    if (CBmapcols != NULL && cells != NULL) {
+        if (CBmapcols(startx, ncols, cells, -1, 0) == 0)
+          return;
+    } else if (CBmapcols != NULL && *(const unsigned char *)&one == 1) {
+        if (CBmapcols(startx, ncols, (const unsigned int *)bp,
+                      fd, (long)phdr->p_offset) == 0)
+          return;
+    }
+    for (j=0; j < 512; ++j) {
+        for (i=0; i < ncols; ++i) {
+            if (cells != NULL) {
+                words[i] = cells[512*i + j] & 0777777;
+            } else {
+                const unsigned char *cp = bp + 4*(512*i + j);
+                words[i] = (cp[0] | cp[1] << 8 | (unsigned int)cp[2] << 16) & 0777777;
+            }
+        }
+        if (CBcopyrow != NULL) {
+            copy_row(startx, j, words, ncols);
+        } else if (CBsetcell != NULL) {
+            for (i=0; i < ncols; ++i)
+              CBsetcell(startx+i, j, words[i]);
+        }
+    }
+}
+
+/* Words are stored as three big-endian bytes, whatever the endianness
+ * of the headers. */
+static void unpack_words(unsigned int *words, const unsigned char *bp, int n)
+{
+    int i;
+    for (i=0; i < n; ++i) {
+        words[i] = (unsigned int)(bp[3*i] & 3) << 16 |
+                   (unsigned int)bp[3*i+1] << 8 | bp[3*i+2];
+    }
+}
+
+/* Hand a run of words to CBcopyrow, split where it wraps around
+ * the right edge of memory. */
+static void copy_row(int sx, int y, const unsigned int *words, int n)
+{
+    sx &= 0777;
+    y &= 0777;
+    if (n <= 0)
+      return;
+    if (sx + n > 512) {
+        CBcopyrow(sx, y, 512 - sx, words);
+        words += 512 - sx;
+        n -= 512 - sx;
+        sx = 0;
+    }
+    CBcopyrow(sx, y, n, words);
 }
 
 
@@ -227,14 +576,10 @@ static int endianness;
 
 /* We need our own struct-writing (and struct-reading) routines
  * to make sure that the endianness of the host isn't a problem. */
-static int read_ehdr(struct ELFHeader *eh, FILE *fp)
+static void read_ehdr(struct ELFHeader *eh, const unsigned char *buffer)
 {
-    unsigned char buffer[sizeof *eh];
-    int rc = fread(buffer, 1, sizeof buffer, fp);
-    if (rc != sizeof buffer) return rc;
     memcpy(eh->e_ident, buffer, 16);
     endianness = eh->e_ident[5];
-    assert(sizeof buffer == 52);
     read_int(buffer+16, &eh->e_type, 2);
     read_int(buffer+18, &eh->e_machine, 2);
     read_int(buffer+20, &eh->e_version, 4);
@@ -248,16 +593,10 @@ static int read_ehdr(struct ELFHeader *eh, FILE *fp)
     read_int(buffer+46, &eh->e_shentsize, 2);
     read_int(buffer+48, &eh->e_shnum, 2);
     read_int(buffer+50, &eh->e_shstrndx, 2);
-    return rc;
 }
 
-static int read_phdr(struct PHdr *ph, FILE *fp)
+static void read_phdr(struct PHdr *ph, const unsigned char *buffer)
 {
-    unsigned char buffer[sizeof *ph];
-    int rc = fread(buffer, 1, sizeof buffer, fp);
-    if (rc != sizeof buffer) return rc;
-    assert(sizeof buffer == 32);
-
     read_int(buffer+0, &ph->p_type, 4);
     read_int(buffer+4, &ph->p_offset, 4);
     read_int(buffer+8, &ph->p_vaddr, 4);
@@ -266,7 +605,6 @@ static int read_phdr(struct PHdr *ph, FILE *fp)
     read_int(buffer+20, &ph->p_memsz, 4);
     read_int(buffer+24, &ph->p_flags, 4);
     read_int(buffer+28, &ph->p_align, 4);
-    return rc;
 }
 
 /* Reads big-endian or little-endian, depending on 'endianness'. */
@@ -53,7 +53,18 @@ static struct PHdr default_bss_PHdr = {
     0,         /* p_align, zero */
 };
 
-enum { FUNG_TEXT, FUNG_BSS };
+static struct PHdr default_image_PHdr = {
+    PT_LOAD,
+    0,         /* p_offset, to be filled in later, page-aligned */
+    0,         /* p_vaddr, first column, to be filled in later */
+    0,         /* p_paddr */
+    0,         /* p_filesz, int, to be filled in later */
+    0,         /* p_memsz, number of columns, to be filled in later */
+    PF_FUNG_IMAGE,
+    FUNG_IMAGE_ALIGN,
+};
+
+enum { FUNG_TEXT, FUNG_BSS, FUNG_IMAGE };
 
 /* The internal representation of an ELF section. */
 struct SavedSection {
@@ -61,11 +72,23 @@ struct SavedSection {
     unsigned int origin, size;
     unsigned int flags;
     unsigned int *data; /* points to (w*h) unsigned ints */
+    unsigned char *packed;  /* run-length coded text, or NULL */
+    unsigned int packedlen;
+    struct PHdr phdr;
     struct SavedSection *next;
 };
 
 
+static void add_section(struct SavedSection *p);
 static void flip_psects(void);
+static void layout_section(struct SavedSection *p, unsigned int *file_offset);
+ static unsigned int image_offset(unsigned int offset);
+ static void pack_section(struct SavedSection *p);
+  static unsigned char *put_run(unsigned char *bp, int kind, int count);
+static void write_section(const struct SavedSection *p, FILE *fp);
+ static void pack_words(unsigned char *bp, const unsigned int *words, int n);
+ static unsigned char *out_reserve(unsigned int n, FILE *fp);
+ static int out_flush(FILE *fp);
 static int write_ehdr(const struct ELFHeader *eh, FILE *fp);
 static int write_phdr(const struct PHdr *ph, FILE *fp);
  static void write_int(unsigned char *bp, unsigned int val, int len);
@@ -73,8 +96,42 @@ static int write_phdr(const struct PHdr *ph, FILE *fp);
 static unsigned int saved_e_entry = -1u;
 static unsigned int saved_fillvalue = -1u;
 static unsigned int saved_e_phnum = 0;
+static int pack_text = 0;
 static struct SavedSection *saved_psects = NULL;
 
+/* Sections are written through 'outbuf'; 'out_offset' is the file
+ * offset just past the last byte in it. When streaming, each section
+ * is written as soon as it's added, and only its header is kept. */
+static unsigned char outbuf[65536];
+static unsigned int outlen = 0;
+static unsigned int out_offset = 0;
+static FILE *stream_fp = NULL;
+static unsigned int stream_capacity = 0;
+
+/* Stream the sections added from now on straight to 'outfp', leaving
+ * room for up to 'nsections' program headers; FungELF_writefile(outfp)
+ * then goes back and fills in the headers. The data passed to
+ * FungELF_addtext() is written out and freed before it returns; that
+ * passed to FungELF_addimage() is written out and isn't copied, so the
+ * caller may free it straight away. Returns -1, and leaves the
+ * sections to be kept until the end as usual, if 'outfp' can't seek,
+ * as a pipe can't. */
+int FungELF_stream(FILE *outfp, unsigned int nsections)
+{
+    unsigned int n = sizeof (struct ELFHeader) + nsections * sizeof (struct PHdr);
+    if (ftell(outfp) != 0 || fseek(outfp, 0, SEEK_SET) != 0)
+      return -1;
+    stream_fp = outfp;
+    stream_capacity = nsections;
+    out_offset = 0;
+    while (n > 0) {
+        unsigned int k = (n < 4096)? n: 4096;
+        memset(out_reserve(k, outfp), 0, k);
+        n -= k;
+    }
+    return 0;
+}
+
 void FungELF_entrypoint(unsigned int e_entry)
 {
     saved_e_entry = e_entry;
@@ -85,21 +142,38 @@ void FungELF_fillvalue(unsigned int value)
     saved_fillvalue = value;
 }
 
+/* 'data' came from malloc(), and is ours from now on. */
 void FungELF_addtext(unsigned int origin, unsigned int size, unsigned int flags, unsigned int *data)
 {
     struct SavedSection *p = malloc(sizeof *p);
-    int len = ((size >> 9) & 0777) * (size & 0777);
     assert(p != NULL);
     p->mode = FUNG_TEXT;
     p->origin = origin;
     p->size = size;
     p->flags = flags;
-    p->data = malloc(len * sizeof *p->data);
-    assert(p->data != NULL);
-    memcpy(p->data, data, len * sizeof *p->data);
-    p->next = saved_psects;
-    saved_psects = p;
-    saved_e_phnum += 1;
+    p->data = data;
+    add_section(p);
+}
+
+/* 'cells' holds 'ncols' whole columns, indexed [x][y]. */
+void FungELF_addimage(unsigned int sx, unsigned int ncols, const unsigned int *cells)
+{
+    struct SavedSection *p = malloc(sizeof *p);
+    int len = ncols * 512;
+    assert(p != NULL);
+    assert(sx + ncols <= 512);
+    p->mode = FUNG_IMAGE;
+    p->origin = sx;
+    p->size = ncols;
+    p->flags = PF_FUNG_IMAGE;
+    if (stream_fp != NULL) {
+        p->data = (unsigned int *)cells;
+    } else {
+        p->data = malloc(len * sizeof *p->data);
+        assert(p->data != NULL);
+        memcpy(p->data, cells, len * sizeof *p->data);
+    }
+    add_section(p);
 }
 
 void FungELF_addbss(unsigned int origin, unsigned int size, unsigned int flags)
@@ -111,9 +185,26 @@ void FungELF_addbss(unsigned int origin, unsigned int size, unsigned int flags)
     p->size = size;
     p->flags = flags;
     p->data = NULL;
+    add_section(p);
+}
+
+static void add_section(struct SavedSection *p)
+{
+    p->packed = NULL;
     p->next = saved_psects;
     saved_psects = p;
     saved_e_phnum += 1;
+    if (stream_fp != NULL) {
+        unsigned int file_offset = out_offset;
+        layout_section(p, &file_offset);
+        write_section(p, stream_fp);
+        /* The header is all we need; an image's data is the caller's. */
+        if (p->mode == FUNG_TEXT)
+          free(p->data);
+        p->data = NULL;
+        free(p->packed);
+        p->packed = NULL;
+    }
 }
 
 static void flip_psects(void)
@@ -128,6 +219,184 @@ static void flip_psects(void)
     saved_psects = p;
 }
 
+/* If 'pack' is nonzero, text sections are written run-length coded,
+ * whenever that makes them smaller. */
+void FungELF_packtext(int pack)
+{
+    pack_text = pack;
+}
+
+/* Runs of S in a PF_FUNG_NEVERMYFILL section become skips; runs of
+ * three or more equal words become repeats; the rest are literals. */
+static void pack_section(struct SavedSection *p)
+{
+    unsigned int myfill = (p->flags & PF_FUNG_FILLVALUE)?
+                            (p->flags & 0777777): -1u;
+    int nevermyfill = ((p->flags & PF_FUNG_NEVERMYFILL) != 0);
+    int h = (p->size >> 9) & 0777;
+    int w = (p->size >> 0) & 0777;
+    int i, j, k;
+    unsigned char *bp;
+
+    /* Never more than a header per cell and the word itself. */
+    p->packed = malloc(5*w*h + 1);
+    assert(p->packed != NULL);
+    bp = p->packed;
+    for (j=0; j < h; ++j) {
+        const unsigned int *row = p->data + j*w;
+        int lit = 0;  /* start of the pending literal run */
+        for (i=0; i < w; i = k) {
+            unsigned int WoRd = row[i] & 0777777;
+            for (k=i+1; k < w && (row[k] & 0777777) == WoRd; ++k)
+              continue;
+            if (!(nevermyfill && WoRd == myfill) && k-i < 3)
+              continue;
+            if (lit < i) {
+                bp = put_run(bp, FUNG_RUN_LITERAL, i-lit);
+                for (; lit < i; ++lit) {
+                    *bp++ = (row[lit] >> 16) & 3;
+                    *bp++ = row[lit] >> 8;
+                    *bp++ = row[lit] >> 0;
+                }
+            }
+            if (nevermyfill && WoRd == myfill) {
+                bp = put_run(bp, FUNG_RUN_SKIP, k-i);
+            } else {
+                bp = put_run(bp, FUNG_RUN_REPEAT, k-i);
+                *bp++ = WoRd >> 16;
+                *bp++ = WoRd >> 8;
+                *bp++ = WoRd >> 0;
+            }
+            lit = k;
+        }
+        if (lit < w) {
+            bp = put_run(bp, FUNG_RUN_LITERAL, w-lit);
+            for (; lit < w; ++lit) {
+                *bp++ = (row[lit] >> 16) & 3;
+                *bp++ = row[lit] >> 8;
+                *bp++ = row[lit] >> 0;
+            }
+        }
+    }
+    p->packedlen = bp - p->packed;
+    if (p->packedlen >= 3u*w*h) {
+        free(p->packed);
+        p->packed = NULL;
+    }
+}
+
+static unsigned char *put_run(unsigned char *bp, int kind, int count)
+{
+    *bp++ = (kind << 6) | (count >> 8);
+    *bp++ = count;
+    return bp;
+}
+
+static unsigned int image_offset(unsigned int offset)
+{
+    return (offset + FUNG_IMAGE_ALIGN-1) / FUNG_IMAGE_ALIGN * FUNG_IMAGE_ALIGN;
+}
+
+/* Work out where a section goes in the file, and its program header.
+ * Text sections are run-length coded here, if that's wanted. */
+static void layout_section(struct SavedSection *p, unsigned int *file_offset)
+{
+    struct PHdr *phdr = &p->phdr;
+    if (p->mode == FUNG_BSS) {
+        *phdr = default_bss_PHdr;
+        phdr->p_memsz = p->size;
+        phdr->p_flags = p->flags;
+    } else if (p->mode == FUNG_TEXT) {
+        *phdr = default_text_PHdr;
+        phdr->p_memsz = p->size;
+        phdr->p_filesz = 3*((p->size >> 9) & 0777)*(p->size & 0777);
+        phdr->p_flags = p->flags;
+        if (pack_text && phdr->p_filesz != 0) {
+            free(p->packed);
+            pack_section(p);
+            if (p->packed != NULL) {
+                phdr->p_filesz = p->packedlen;
+                phdr->p_flags |= PF_FUNG_PACKED;
+            }
+        }
+    } else {
+        *phdr = default_image_PHdr;
+        *file_offset = image_offset(*file_offset);
+        phdr->p_memsz = p->size;
+        phdr->p_filesz = 4*512*p->size;
+    }
+    phdr->p_offset = *file_offset;
+    phdr->p_paddr = phdr->p_vaddr = p->origin;
+    *file_offset += phdr->p_filesz;
+}
+
+/* Write a section's data through the output buffer, padding out to
+ * where layout_section() put it. */
+static void write_section(const struct SavedSection *p, FILE *fp)
+{
+    while (out_offset < p->phdr.p_offset) {
+        *out_reserve(1, fp) = 0;
+    }
+    if (p->mode == FUNG_BSS) {
+        return;
+    } else if (p->mode == FUNG_TEXT && p->packed != NULL) {
+        unsigned int i;
+        for (i=0; i < p->packedlen; i += 4096) {
+            unsigned int n = (p->packedlen - i < 4096)? p->packedlen - i: 4096;
+            memcpy(out_reserve(n, fp), p->packed + i, n);
+        }
+    } else if (p->mode == FUNG_TEXT) {
+        int h = (p->size >> 9) & 0777;
+        int w = (p->size >> 0) & 0777;
+        int j;
+        for (j=0; j < h; ++j)
+          pack_words(out_reserve(3*w, fp), p->data + j*w, w);
+    } else if (p->mode == FUNG_IMAGE) {
+        unsigned int i, n = 512 * p->size;
+        /* Four bytes per cell, little-endian,
+         * just as the simulator keeps them. */
+        for (i=0; i < n; ++i) {
+            unsigned char *bp = out_reserve(4, fp);
+            unsigned int WoRd = p->data[i] & 0777777;
+            bp[0] = WoRd >> 0;
+            bp[1] = WoRd >> 8;
+            bp[2] = WoRd >> 16;
+            bp[3] = 0;
+        }
+    }
+}
+
+/* Three bytes per uint18; the high 6 bits
+ * are ignored, so let's make them zero. */
+static void pack_words(unsigned char *bp, const unsigned int *words, int n)
+{
+    int i;
+    for (i=0; i < n; ++i) {
+        bp[3*i+0] = words[i] >> 16;
+        bp[3*i+1] = words[i] >> 8;
+        bp[3*i+2] = words[i] >> 0;
+    }
+}
+
+/* Room for 'n' more bytes of output; 'n' is never more than a row. */
+static unsigned char *out_reserve(unsigned int n, FILE *fp)
+{
+    unsigned char *bp;
+    if (outlen + n > sizeof outbuf)
+      out_flush(fp);
+    bp = outbuf + outlen;
+    outlen += n;
+    out_offset += n;
+    return bp;
+}
+
+static int out_flush(FILE *fp)
+{
+    int rc = (fwrite(outbuf, 1, outlen, fp) == outlen)? 0: -1;
+    outlen = 0;
+    return rc;
+}
+
 int FungELF_writefile(FILE *outfp)
 {
     struct ELFHeader ehdr = default_EHdr;
@@ -141,6 +410,16 @@ int FungELF_writefile(FILE *outfp)
     if (saved_fillvalue != -1u) {
         ehdr.e_flags =  PF_FUNG_FILLVALUE | (saved_fillvalue & 0777777);
     }
+
+    if (stream_fp != NULL) {
+        /* The sections are out already; go back and fill in the
+         * headers we left room for. */
+        if (outfp != stream_fp || saved_e_phnum > stream_capacity)
+          return -1;
+        if (out_flush(outfp) != 0 || fseek(outfp, 0, SEEK_SET) != 0)
+          return -1;
+    }
+
     if (write_ehdr(&ehdr, outfp) != sizeof ehdr)
       return -1;
 
@@ -149,50 +428,23 @@ int FungELF_writefile(FILE *outfp)
     file_offset += saved_e_phnum * sizeof (struct PHdr);
 
     for (p = saved_psects; p != NULL; p = p->next) {
-        struct PHdr phdr;
-        if (p->mode == FUNG_BSS) {
-            phdr = default_bss_PHdr;
-            phdr.p_offset = file_offset;
-            phdr.p_paddr = phdr.p_vaddr = p->origin;
-            phdr.p_memsz = p->size;
-            phdr.p_flags = p->flags;
-        } else if (p->mode == FUNG_TEXT) {
-            phdr = default_text_PHdr;
-            phdr.p_offset = file_offset;
-            phdr.p_paddr = phdr.p_vaddr = p->origin;
-            phdr.p_memsz = p->size;
-            phdr.p_filesz = 3*((p->size >> 9) & 0777)*(p->size & 0777);
-            phdr.p_flags = p->flags;
-        } else return -4;
-        file_offset += phdr.p_filesz;
-        if (write_phdr(&phdr, outfp) != sizeof phdr)
+        if (stream_fp == NULL)
+          layout_section(p, &file_offset);
+        if (write_phdr(&p->phdr, outfp) != sizeof p->phdr)
           return -1;
     }
+    if (stream_fp != NULL)
+      return (fseek(outfp, 0, SEEK_END) == 0)? 0: -1;
 
     /* Okay, the table of contents has been output.
      * Now output the section entries themselves. */
-    for (p = saved_psects; p != NULL; p = p->next) {
-        if (p->mode == FUNG_BSS) {
-            continue;
-        } else if (p->mode == FUNG_TEXT) {
-            int h = (p->size >> 9) & 0777;
-            int w = (p->size >> 0) & 0777;
-            int i, j;
-            /* Three bytes per uint18; the high 6 bits
-             * are ignored, so let's make them zero. */
-            for (j=0; j < h; ++j) {
-                for (i=0; i < w; ++i) {
-                    unsigned int WoRd = p->data[j*w+i];
-                    putc((0 << 2) | (WoRd >> 16), outfp);
-                    putc(WoRd >> 8, outfp);
-                    putc(WoRd >> 0, outfp);
-                }
-            }
-        } else return -4;
-    }
+    out_offset = sizeof ehdr;
+    out_offset += saved_e_phnum * sizeof (struct PHdr);
+    for (p = saved_psects; p != NULL; p = p->next)
+      write_section(p, outfp);
 
     /* All done! */
-    return 0;
+    return out_flush(outfp);
 }
 
 void FungELF_done(void)
@@ -200,12 +452,67 @@ void FungELF_done(void)
     while (saved_psects != NULL) {
         struct SavedSection *q = saved_psects->next;
         free(saved_psects->data);
+        free(saved_psects->packed);
         free(saved_psects);
         saved_psects = q;
     }
     saved_e_entry = -1u;
     saved_e_phnum = 0;
     saved_fillvalue = -1u;
+    stream_fp = NULL;
+    stream_capacity = 0;
+    outlen = 0;
+    out_offset = 0;
+}
+
+/* The data of each section is handed over as it is, so nothing is
+ * copied; only the word values are masked, as writing them would. */
+struct FungELF_Image *FungELF_takeimage(void)
+{
+    struct FungELF_Image *img = malloc(sizeof *img);
+    struct SavedSection *p;
+    int i;
+
+    assert(img != NULL);
+    assert(stream_fp == NULL);
+    flip_psects();
+    img->entry = saved_e_entry;
+    img->fillvalue = saved_fillvalue;
+    img->nsections = saved_e_phnum;
+    img->sections = malloc((saved_e_phnum + 1) * sizeof *img->sections);
+    assert(img->sections != NULL);
+
+    for (p = saved_psects, i = 0; p != NULL; p = p->next, ++i) {
+        struct FungELF_Section *s = &img->sections[i];
+        unsigned int k, n = 0;
+        if (p->mode == FUNG_TEXT)
+          n = ((p->size >> 9) & 0777) * (p->size & 0777);
+        else if (p->mode == FUNG_IMAGE)
+          n = 512 * p->size;
+        s->origin = p->origin;
+        s->size = p->size;
+        s->flags = p->flags;
+        s->cells = NULL;
+        if (n != 0) {
+            s->cells = p->data;
+            p->data = NULL;
+            for (k=0; k < n; ++k)
+              s->cells[k] &= 0777777;
+        }
+    }
+    FungELF_done();
+    return img;
+}
+
+void FungELF_freeimage(struct FungELF_Image *img)
+{
+    int i;
+    if (img == NULL)
+      return;
+    for (i=0; i < img->nsections; ++i)
+      free(img->sections[i].cells);
+    free(img->sections);
+    free(img);
 }
 
 /* We need our own struct-writing (and struct-reading) routines
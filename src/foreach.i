@@ -9,7 +9,9 @@
 #include INCLUDENAME
 #undef OP
 #define OP /
+#define OP_DIVIDES
 #include INCLUDENAME
+#undef OP_DIVIDES
 #undef OP
 #define OP &
 #include INCLUDENAME
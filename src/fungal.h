@@ -6,6 +6,7 @@
   extern "C" {
  #endif
 
+#include <stddef.h>
 #include "asmtypes.h"
 
 #define IS_VECTOR 01000000
@@ -19,8 +20,17 @@ unsigned int eval_scalar(const char *text, int *len);
 
 /* If fungasm() fails, it will return an out-of-range value,
  * and this indicator will point to a string describing a
- * problem with the input. */
-extern const char *fungasm_error;
+ * problem with the input. Like errno, each thread has its own,
+ * so that different threads can assemble at the same time. */
+const char **fungasm_error_location(void);
+#define fungasm_error (*fungasm_error_location())
+
+/* The whole assembler, as a library: see asmmain.c. Link with the
+ * object built from it with FUNGASM_LIBRARY defined, which has no
+ * main(). Free the result with FungELF_freeimage(). */
+struct FungELF_Image;
+struct FungELF_Image *fungasm_source(const char *text, size_t len,
+                                     char *errbuf, size_t errlen);
 
  #ifdef __cplusplus
   }
@@ -7,14 +7,15 @@
 #include <string.h>
 #include "fungal.h"
 
-const char *fungasm_error;
+static _Thread_local const char *error_message;
 static unsigned int error(const char *fmt, ...);
 static void *Nerror(const char *fmt, ...);
  static void verror(const char *fmt, va_list ap);
 
 enum { OP_NONE=-1,
        OP_INC=4, OP_INV=2, OP_DEC=5, OP_DEV=3, OP_NOT=0, OP_SHR=1,
-       OP_PLUS=0, OP_MINUS=1, OP_AND=2, OP_OR=3, OP_XOR=4 };
+       OP_SHF=6, OP_SWP=7,
+       OP_PLUS=0, OP_MINUS=1, OP_AND=2, OP_OR=3, OP_XOR=4, OP_MUL=5, OP_DIV=6 };
 
 static const char *get_char_literal(const char *ip, unsigned int *lval);
 
@@ -24,7 +25,7 @@ static unsigned int arithmetic_op(const char *text, const char *ip, unsigned int
 static unsigned int eval_register(const char *text, int *len);
 static unsigned int eval_mem(const char *text, int *len);
 
-static int maskingmode;
+static _Thread_local int maskingmode;
 static unsigned int apply_masking_mode(unsigned int inst);
 
 
@@ -163,10 +164,19 @@ unsigned int fungasm(const char *text)
             return arithmetic_op(text, ip+mlen, 0400200);
         } else if (!strncmp(ip, "XOR", 3)) {
             return arithmetic_op(text, ip+mlen, 0400400);
+        } else if (!strncmp(ip, "MUL", 3)) {
+            return arithmetic_op(text, ip+mlen, 0400500);
+        } else if (!strncmp(ip, "DIV", 3)) {
+            return arithmetic_op(text, ip+mlen, 0400600);
         } else if (!strncmp(ip, "NOT", 3)) {
             return arithmetic_op(text, ip+mlen, 0400700);
         } else if (!strncmp(ip, "SHR", 3)) {
             return arithmetic_op(text, ip+mlen, 0400701);
+        } else if (!strncmp(ip, "SHF", 3)) {
+            /* "SHF $X, $A" shifts $A by the signed count in $X.x. */
+            return arithmetic_op(text, ip+mlen, 0400706);
+        } else if (!strncmp(ip, "SWP", 3)) {
+            return arithmetic_op(text, ip+mlen, 0400707);
         } else if (!strncmp(ip, "SHL", 3)) {
             /* "SHL $X, $A" is an alias for "ADD $X, $A, $A". */
             int len;
@@ -408,7 +418,7 @@ char *find_token(const char *text, int *len, unsigned int *value)
             case '\0':
                 return NULL;
             case '[': case ']': case '*': case '&': case '|': case '^':
-            case '(': case ')': case ',': case '.': case '~':
+            case '(': case ')': case ',': case '.': case '~': case '/':
                 ret = ip++;
                 break;
             case '+':  /* match '++' and '+' */
@@ -419,6 +429,13 @@ char *find_token(const char *text, int *len, unsigned int *value)
                 ret = ip;
                 if (ip[1] != '>')
                   return Nerror("Unrecognized token beginning with '>'");
+                ip += 2;
+                break;
+            case '<':  /* match '<<' and '<>' */
+                ret = ip;
+                if (ip[1] != '<' && ip[1] != '>')
+                  return Nerror("Unrecognized token beginning with '<'");
+                ip += 2;
                 break;
             case '\'': { /* match a character constant */
                 unsigned int dummy;
@@ -649,6 +666,8 @@ static unsigned int eval_mem(const char *text, int *len)
             case '&': op = OP_AND; break;
             case '|': op = OP_OR; break;
             case '^': op = OP_XOR; break;
+            case '*': op = OP_MUL; break;
+            case '/': op = OP_DIV; break;
             default:
                 return error("Unexpected \"%c\" after register in memory reference", *ip);
         }
@@ -671,6 +690,12 @@ static unsigned int eval_mem(const char *text, int *len)
         op = OP_NOT;
     } else if (*ip == '>') {
         op = OP_SHR;
+    } else if (*ip == '<' && ip[1] == '<') {
+        /* SHF would take its count from X, which here is the register
+         * being loaded or stored; that's never what anyone means. */
+        return error("SHF has no memory form; \"<<\" can't be used in a memory reference");
+    } else if (*ip == '<') {
+        op = OP_SWP;
     } else {
         return error("Expected a register number in memory reference \"%s\"", text);
     }
@@ -701,9 +726,14 @@ static unsigned int apply_masking_mode(unsigned int inst)
 }
 
 
+const char **fungasm_error_location(void)
+{
+    return &error_message;
+}
+
 static void verror(const char *fmt, va_list ap)
 {
-    static char fungasm_error_buffer[100];
+    static _Thread_local char fungasm_error_buffer[100];
     if (fungasm_error == NULL) {
         vsprintf(fungasm_error_buffer, fmt, ap);
         fungasm_error = fungasm_error_buffer;
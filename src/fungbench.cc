@@ -0,0 +1,254 @@
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fungus.h"
+#include "uint18.h"
+
+/* Microbenchmarks for the simulator's hot paths: the uint18 operators,
+ * in each masking mode, and the dispatch of each kind of instruction
+ * through step(). The uint18 operators are stamped out by the foreach.i
+ * include trick, so it's hard to guess from the source what they cost.
+ *
+ * Each benchmark runs several trials; we report the fastest and the
+ * median, in host nanoseconds per operation. */
+
+#define NVALUES 1024        /* power of two */
+#define OPS_PER_TRIAL 2000000u
+
+static uint18 values[NVALUES];
+static volatile unsigned int sink;
+
+static const char *ModeName[] = { "vector", "x", "y", "scalar" };
+
+static int NumTrials = 7;
+static const char *Filter = NULL;
+
+static void pin_to_cpu(int cpu);
+static double now(void);
+static void report(const char *name, int mode, double *ns);
+static void bench_uint18(int mode);
+static void bench_dispatch(int mode);
+ static void ignore_exception(unsigned int inst);
+static void do_help(int man);
+
+
+int main(int argc, char *argv[])
+{
+    int cpu = 0;
+    int i, mode;
+
+    for (i=1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-n") && i+1 < argc) {
+            NumTrials = atoi(argv[++i]);
+            if (NumTrials < 1) NumTrials = 1;
+            if (NumTrials > 64) NumTrials = 64;
+        } else if (!strcmp(argv[i], "-c") && i+1 < argc) {
+            cpu = atoi(argv[++i]);
+        } else if (argv[i][0] == '-') {
+            do_help(!strcmp(argv[i], "--man"));
+        } else {
+            Filter = argv[i];
+        }
+    }
+
+    pin_to_cpu(cpu);
+
+    for (i=0; i < NVALUES; ++i)
+      values[i] = uint18((rand() ^ (rand() << 9)) & 0777777);
+
+    printf("%-24s %-7s %10s %10s\n", "benchmark", "mode", "min ns", "median ns");
+    for (mode = MaskVector; mode <= MaskScalar; ++mode)
+      bench_uint18(mode);
+    for (mode = MaskVector; mode <= MaskScalar; ++mode)
+      bench_dispatch(mode);
+    return 0;
+}
+
+
+static void pin_to_cpu(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof set, &set) != 0)
+      printf("Warning: couldn't pin to CPU %d; timings may be noisy\n", cpu);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+    return (da < db)? -1: (da > db);
+}
+
+static void report(const char *name, int mode, double *ns)
+{
+    qsort(ns, NumTrials, sizeof *ns, cmp_double);
+    printf("%-24s %-7s %10.2f %10.2f\n", name, ModeName[mode],
+        ns[0], ns[NumTrials/2]);
+}
+
+static int wanted(const char *name)
+{
+    return (Filter == NULL || strstr(name, Filter) != NULL);
+}
+
+
+/* Time one uint18 expression, 'EXPR', over the 'values' array.
+ * Each iteration is independent of the last, so this measures
+ * throughput rather than latency. */
+#define BENCH_OP(name, EXPR) do {                                   \
+    if (wanted(name)) {                                             \
+        double ns[64];                                              \
+        int t;                                                      \
+        for (t=0; t < NumTrials; ++t) {                             \
+            unsigned int acc = 0;                                   \
+            unsigned int i;                                         \
+            double t0 = now();                                      \
+            for (i=0; i < OPS_PER_TRIAL; ++i) {                     \
+                const uint18 &a = values[i & (NVALUES-1)];          \
+                const uint18 &b = values[(i+1) & (NVALUES-1)];      \
+                acc ^= (unsigned int)(EXPR);                        \
+                (void)a; (void)b;                                   \
+            }                                                       \
+            ns[t] = (now() - t0) / OPS_PER_TRIAL;                   \
+            sink = acc;                                             \
+        }                                                           \
+        report(name, mode, ns);                                     \
+    }                                                               \
+} while (0)
+
+static unsigned int do_setm(const uint18 &a, const uint18 &b)
+{
+    uint18 tmp(a);
+    tmp.setm(b);
+    return tmp;
+}
+
+static void bench_uint18(int mode)
+{
+    currentMode = (enum MaskingModes)mode;
+    BENCH_OP("uint18 +", a + b);
+    BENCH_OP("uint18 -", a - b);
+    BENCH_OP("uint18 &", a & b);
+    BENCH_OP("uint18 |", a | b);
+    BENCH_OP("uint18 ^", a ^ b);
+    BENCH_OP("uint18 *", a * b);
+    BENCH_OP("uint18 /", a / b);
+    BENCH_OP("uint18 ~", ~a);
+    BENCH_OP("uint18 <<", a << 1u);
+    BENCH_OP("uint18 >>", a >> 1u);
+    BENCH_OP("uint18 setm", do_setm(a, b));
+    BENCH_OP("uint18 getm", a.getm());
+}
+
+#undef BENCH_OP
+
+
+/* A synthetic instruction stream is the same instruction in every cell
+ * of memory, so that the PC can wander wherever it likes. Registers
+ * $3, $4 and $5 are the operands; $3 holds the instruction itself,
+ * so that SW $3 stores leave the stream unchanged. */
+struct Stream {
+    const char *name;
+    unsigned int inst;  /* without masking-mode bits */
+};
+
+static const struct Stream streams[] = {
+    { "group0 TRP",       0000101 },
+    { "group0 LI",        0013123 },
+    { "group0 LV",        0023123 },
+    { "group0 SZ",        0033000 },
+    { "group0 SNZ",       0043000 },
+    { "group0 DZ",        0053000 },
+    { "group0 DNZ",       0063000 },
+    { "group0 RET",       0070000 },
+    { "nazg ADD",         0403045 },
+    { "nazg SUB",         0403145 },
+    { "nazg AND",         0403245 },
+    { "nazg OR",          0403345 },
+    { "nazg XOR",         0403445 },
+    { "nazg MUL",         0403545 },
+    { "nazg DIV",         0403645 },
+    { "nazgUnary NOT",    0403740 },
+    { "nazgUnary SHR",    0403741 },
+    { "nazgUnary INV",    0403742 },
+    { "nazgUnary DEV",    0403743 },
+    { "nazgUnary INC",    0403744 },
+    { "nazgUnary DEC",    0403745 },
+    { "nazgUnary SHF",    0403746 },
+    { "nazgUnary SWP",    0403747 },
+    { "group1 LW",        0413045 },
+    { "group1 LX",        0423045 },
+    { "group1 LY",        0433045 },
+    { "group1 SW",        0443045 },
+    { "group1 SX",        0453045 },
+    { "group1 SY",        0463045 },
+    { "group1 LMR",       0473070 },
+};
+
+static void ignore_exception(unsigned int inst)
+{
+    (void)inst;
+}
+
+static void bench_dispatch(int mode)
+{
+    unsigned int k;
+    onException(ignore_exception);
+    for (k=0; k < sizeof streams / sizeof *streams; ++k) {
+        unsigned int inst = streams[k].inst | (mode << 15);
+        double ns[64];
+        unsigned int x, y;
+        int t;
+
+        if (!wanted(streams[k].name))
+          continue;
+        for (y=0; y <= 0777; ++y)
+          for (x=0; x <= 0777; ++x)
+            setmem(x, y, inst);
+
+        for (t=0; t < NumTrials; ++t) {
+            double t0;
+            initMachine();
+            setReg(1, 0);
+            setReg(2, 1);
+            setReg(3, inst);
+            setReg(4, 0123456);
+            setReg(5, 0654321);
+            t0 = now();
+            runFor(OPS_PER_TRIAL);
+            ns[t] = (now() - t0) / OPS_PER_TRIAL;
+        }
+        report(streams[k].name, mode, ns);
+    }
+}
+
+
+static void do_help(int man)
+{
+    puts("Usage: fungbench [-n trials] [-c cpu] [filter]");
+    if (man) {
+        puts("");
+        puts("  fungbench measures the host cost of the simulator's primitive");
+        puts("operations: each uint18 operator in each masking mode, and the");
+        puts("dispatch of each kind of instruction through step(), running");
+        puts("synthetic streams made of that single instruction. It pins");
+        puts("itself to one CPU (default 0), runs each benchmark for several");
+        puts("trials (default 7), and reports the fastest and the median trial");
+        puts("in nanoseconds per operation.");
+        puts("  If a filter is given, only benchmarks whose names contain it");
+        puts("are run; for example, \"fungbench nazg\".");
+    }
+    exit(EXIT_FAILURE);
+}
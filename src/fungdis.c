@@ -80,8 +80,8 @@ const char *disasm(unsigned int inst)
                 case 2: sprintf(buffer, "AND%s\t%s, %s, %s", Mask[M], reg(X), reg(A), reg(B)); break;
                 case 3: sprintf(buffer, "OR%s\t%s, %s, %s",  Mask[M], reg(X), reg(A), reg(B)); break;
                 case 4: sprintf(buffer, "XOR%s\t%s, %s, %s", Mask[M], reg(X), reg(A), reg(B)); break;
-                case 5: goto print_word;
-                case 6: goto print_word;
+                case 5: sprintf(buffer, "MUL%s\t%s, %s, %s", Mask[M], reg(X), reg(A), reg(B)); break;
+                case 6: sprintf(buffer, "DIV%s\t%s, %s, %s", Mask[M], reg(X), reg(A), reg(B)); break;
                 case 7:
                     switch (B) {
                         case 0: sprintf(buffer, "NOT%s\t%s, %s", Mask[M], reg(X), reg(A)); break;
@@ -100,8 +100,8 @@ const char *disasm(unsigned int inst)
                             else
                               sprintf(buffer, "DEC%s\t%s, %s", Mask[M], reg(X), reg(A));
                             break;
-                        case 6: goto print_word;
-                        case 7: goto print_word;
+                        case 6: sprintf(buffer, "SHF%s\t%s, %s", Mask[M], reg(X), reg(A)); break;
+                        case 7: sprintf(buffer, "SWP%s\t%s, %s", Mask[M], reg(X), reg(A)); break;
                     }
                     break;
             }
@@ -146,8 +146,8 @@ static const char *nazg(int ALU, int A, int B)
         case 2: sprintf(buffer, "%s&%s", reg(A), reg(B)); break;
         case 3: sprintf(buffer, "%s|%s", reg(A), reg(B)); break;
         case 4: sprintf(buffer, "%s^%s", reg(A), reg(B)); break;
-        case 5: return NULL;
-        case 6: return NULL;
+        case 5: sprintf(buffer, "%s*%s", reg(A), reg(B)); break;
+        case 6: sprintf(buffer, "%s/%s", reg(A), reg(B)); break;
         case 7:
             switch (B) {
                 case 0: sprintf(buffer, "~%s", reg(A)); break;
@@ -156,8 +156,8 @@ static const char *nazg(int ALU, int A, int B)
                 case 3: sprintf(buffer, "--%s", reg(A)); break;
                 case 4: sprintf(buffer, "+%s", reg(A)); break;
                 case 5: sprintf(buffer, "-%s", reg(A)); break;
-                case 6: return NULL;
-                case 7: return NULL;
+                case 6: return NULL;  /* SHF, counting by X; not assemblable */
+                case 7: sprintf(buffer, "<>%s", reg(A)); break;
             }
             break;
     }
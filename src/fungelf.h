@@ -12,23 +12,85 @@ typedef int (*cbns_t)(int sx, int sy, int w, int h, int hastext);
 typedef unsigned int (*cbgc_t)(int x, int y);
 typedef int (*cbsc_t)(int x, int y, unsigned int value);
 typedef int (*cbse_t)(int x, int y);
+typedef int (*cbfr_t)(int sx, int sy, int w, int h, unsigned int value);
+typedef int (*cbcr_t)(int sx, int y, int n, const unsigned int *words);
+typedef int (*cbmc_t)(int sx, int ncols, const unsigned int *cells,
+                      int fd, long offset);
 
 /* ELF reading functions for simfunge. */
 int FungELF_loadelf(FILE *fp, cbns_t cbns, cbgc_t cbgc, cbsc_t cbsc, cbse_t cbse);
 int FungELF_loadascii(FILE *fp, cbns_t cbns, cbgc_t cbgc, cbsc_t cbsc, cbse_t cbse);
 int FungELF_load(FILE *fp, cbns_t cbns, cbgc_t cbgc, cbsc_t cbsc, cbse_t cbse);
 
+/* The same, with the callbacks in a structure, so that a loader can
+ * offer bulk operations. Any callback may be NULL. If 'fillrect' is
+ * given, the global fill and BSS sections go through it, a rectangle
+ * at a time, rather than through 'setcell' a cell at a time; the
+ * rectangle may wrap around the edges of memory. If 'copyrow' is
+ * given, text sections and ASCII lines go through it, a run of 'n'
+ * words at a time, starting at (sx,y) and going right; a run never
+ * wraps. If 'mapcols' is given, each native image section is offered
+ * to it first: 'ncols' whole columns starting at column 'sx', as
+ * 'cells', in the host's byte order, indexed [x][y] like simfunge's
+ * memory. They are also at 'offset' in the open file 'fd', page-
+ * aligned, unless 'fd' is -1. 'cells' is only valid during the call.
+ * If it returns nonzero, the section is loaded a row at a time. */
+struct FungELF_Callbacks {
+    cbns_t newsection;
+    cbgc_t getcell;
+    cbsc_t setcell;
+    cbse_t setentry;
+    cbfr_t fillrect;
+    cbcr_t copyrow;
+    cbmc_t mapcols;
+};
+int FungELF_loadx(FILE *fp, const struct FungELF_Callbacks *cb);
+int FungELF_loadelfx(FILE *fp, const struct FungELF_Callbacks *cb);
+
+/* A program held in memory rather than in a file: the sections an ELF
+ * file would have, in the same order, with 'origin', 'size' and 'flags'
+ * as in their program headers. The cells of a text section are kept
+ * unpacked, 'w' times 'h' of them, row after row; a native image
+ * section keeps its 'size' columns, [x][y]; 'cells' is NULL for a BSS
+ * section. 'entry' and 'fillvalue' are -1u if the program has none.
+ * FungELF_loadimage() loads one just as the equivalent file would be
+ * loaded, and returns the number of sections. */
+struct FungELF_Section {
+    unsigned int origin, size;
+    unsigned int flags;
+    unsigned int *cells;
+};
+struct FungELF_Image {
+    unsigned int entry;
+    unsigned int fillvalue;
+    int nsections;
+    struct FungELF_Section *sections;
+};
+int FungELF_loadimage(const struct FungELF_Image *img,
+        const struct FungELF_Callbacks *cb);
+
 const char *FungELF_strerror(int rc);
 
-/* ELF writing functions for fungasm. */
+/* ELF writing functions for fungasm. FungELF_addtext() takes over
+ * 'data', which must come from malloc(); FungELF_addimage() doesn't. */
 void FungELF_entrypoint(unsigned int origin);
 void FungELF_fillvalue(unsigned int value);
 void FungELF_addtext(unsigned int origin, unsigned int size,
         unsigned int flags, unsigned int *data);
 void FungELF_addbss(unsigned int origin, unsigned int size,
         unsigned int flags);
+void FungELF_addimage(unsigned int sx, unsigned int ncols,
+        const unsigned int *cells);
+void FungELF_packtext(int pack);
+int FungELF_stream(FILE *outfp, unsigned int nsections);
 int FungELF_writefile(FILE *outfp);
 
+/* Instead of writing a file, hand over everything added so far as a
+ * FungELF_Image, and clear the buffers as FungELF_done() does. Not
+ * for use while streaming. FungELF_freeimage() frees the result. */
+struct FungELF_Image *FungELF_takeimage(void);
+void FungELF_freeimage(struct FungELF_Image *img);
+
 /* Clears the buffers so that a new ELF file can be written. */
 void FungELF_done(void);
 
@@ -41,9 +103,28 @@ void FungELF_done(void);
  * PF_FUNG_NEVERMYFILL means, "If the ELF file says this memory cell should
  * get S, then don't write anything into this memory cell." In other words,
  * S is a "transparent color".
+ * PF_FUNG_IMAGE marks a native image section: whole columns of cells,
+ * four bytes each, little-endian with the top 14 bits zero, column
+ * after column, starting at a page boundary in the file. p_vaddr is
+ * the first column, and p_memsz is the number of columns. This is the
+ * simulator's own memory layout, so a loader may map the section
+ * straight into memory.
+ * PF_FUNG_PACKED marks a text section whose rows are run-length coded.
+ * Each row is a series of runs that together cover its width. A run
+ * starts with a two-byte big-endian header, the kind in the top two
+ * bits and the count of cells in the rest. A literal run is followed
+ * by that many three-byte words; a repeat run by a single word; a skip
+ * run, by nothing, and its cells are left as they were, as S is with
+ * PF_FUNG_NEVERMYFILL.
  */
 #define PF_FUNG_FILLVALUE    01000000
 #define PF_FUNG_NEVERMYFILL  02000000
+#define PF_FUNG_IMAGE        04000000
+#define PF_FUNG_PACKED       010000000
+#define FUNG_RUN_LITERAL     0
+#define FUNG_RUN_REPEAT      1
+#define FUNG_RUN_SKIP        2
+#define FUNG_IMAGE_ALIGN     4096
 
 
 /* felfin and felfout share these structures.
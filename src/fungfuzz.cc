@@ -0,0 +1,367 @@
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fungus.h"
+
+/* A differential fuzzer for the simulator's execution engines.
+ *
+ * step() is the reference implementation of the Fungus machine; every
+ * faster way of running the machine must agree with it exactly. This
+ * harness generates random memory images and register files, runs each
+ * one on the reference and on the engine under test in lockstep, one
+ * block of instructions at a time, and compares the complete machine
+ * state (registers, MSRs, counters and all of memory) after each block.
+ *
+ * The machine is rewound with restoreMachine() rather than by starting
+ * a new process, so a run of a million programs takes an hour, not a
+ * week. Every program is generated from its own seed, so a mismatch can
+ * be reproduced with "fungfuzz -s seed -n 1". */
+
+#define steq(x,y) (!strcmp(x,y))
+
+struct Engine {
+    const char *name;
+    void (*run)(unsigned int steps);
+};
+
+static void reference(unsigned int steps);
+
+/* Engines under test. Add new execution engines here. */
+static const struct Engine engines[] = {
+    { "runFor", runFor },
+};
+
+static struct FungusState states[2];
+static unsigned long exceptions;
+
+static unsigned long NumPrograms = 1000;
+static unsigned int NumBlocks = 8;
+static unsigned int BlockSize = 512;
+static int Verbose = 0;
+
+static int fuzz_one(const struct Engine *engine, unsigned long seed);
+ static void random_machine(unsigned long seed, struct FungusState *s);
+  static unsigned int random18(void);
+ static int compare_machine(const struct FungusState *ref,
+                            unsigned long xref, unsigned long xgot);
+static void count_exception(unsigned int inst);
+static void do_error(const char *fmat, ...);
+static void do_help(int man);
+
+
+int main(int argc, char *argv[])
+{
+    const struct Engine *engine = &engines[0];
+    unsigned long seed = time(NULL);
+    unsigned long n, failures = 0;
+    clock_t t0;
+    double secs;
+    int i;
+
+    for (i=1; i < argc; i++)
+    {
+        if (argv[i][0] != '-') break;
+        if (argv[i][1] == '\0') break;
+
+        if (steq(argv[i]+1, "-")) { ++i; break; }
+        else if (steq(argv[i]+1, "?")) do_help(0);
+        else if (steq(argv[i]+1, "-help")) do_help(0);
+        else if (steq(argv[i]+1, "-man")) do_help(1);
+        else if (steq(argv[i], "-v")) Verbose = 1;
+        else if (i >= argc-1) {
+            do_error("Option %s needs an argument\n", argv[i]);
+        } else if (steq(argv[i], "-n")) {
+            NumPrograms = strtoul(argv[++i], NULL, 0);
+        } else if (steq(argv[i], "-k")) {
+            NumBlocks = strtoul(argv[++i], NULL, 0);
+        } else if (steq(argv[i], "-b")) {
+            BlockSize = strtoul(argv[++i], NULL, 0);
+        } else if (steq(argv[i], "-s")) {
+            seed = strtoul(argv[++i], NULL, 0);
+        } else if (steq(argv[i], "-e")) {
+            unsigned int k;
+            ++i;
+            for (k=0; k < sizeof engines / sizeof *engines; ++k) {
+                if (steq(argv[i], engines[k].name)) break;
+            }
+            if (k == sizeof engines / sizeof *engines)
+              do_error("Unknown engine \"%s\"\n", argv[i]);
+            engine = &engines[k];
+        } else {
+            do_error("Unrecognized option %s\n", argv[i]);
+        }
+    }
+    if (i != argc) do_help(0);
+
+    onException(count_exception);
+    printf("Fuzzing %s against step(): %lu programs of %u x %u steps,"
+        " starting at seed %lu\n", engine->name, NumPrograms,
+        NumBlocks, BlockSize, seed);
+
+    t0 = clock();
+    for (n=0; n < NumPrograms; ++n) {
+        if (!fuzz_one(engine, seed + n))
+          failures += 1;
+    }
+    secs = (double)(clock() - t0) / CLOCKS_PER_SEC;
+
+    printf("%lu programs, %lu mismatches, %.0f programs/sec\n",
+        NumPrograms, failures, (secs > 0)? NumPrograms / secs: 0);
+    return (failures != 0);
+}
+
+
+static void reference(unsigned int steps)
+{
+    while (steps--)
+      step();
+}
+
+/* Run one random program. Returns 1 if the engine agreed with the
+ * reference after every block, or 0 (having said why) if not. */
+static int fuzz_one(const struct Engine *engine, unsigned long seed)
+{
+    struct FungusState *start = &states[0];
+    struct FungusState *ref = &states[1];
+    unsigned int b;
+
+    random_machine(seed, start);
+    restoreMachine(start);
+    for (b=0; b < NumBlocks; ++b) {
+        struct FungusState *t;
+        unsigned long xref, xgot;
+
+        exceptions = 0;
+        reference(BlockSize);
+        xref = exceptions;
+        saveMachine(ref);
+
+        restoreMachine(start);
+        exceptions = 0;
+        engine->run(BlockSize);
+        xgot = exceptions;
+
+        if (!compare_machine(ref, xref, xgot)) {
+            printf("  in program with seed %lu, block %u\n", seed, b);
+            return 0;
+        }
+        /* The machine is now in the state the next block starts from. */
+        t = start; start = ref; ref = t;
+    }
+    if (Verbose)
+      printf("seed %lu: ok, %lu instructions\n", seed, retired);
+    return 1;
+}
+
+
+/* A small xorshift generator; rand() is too slow to fill
+ * 256K cells per program, and its sequence isn't portable. */
+static unsigned int rng_state;
+
+static unsigned int random18(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return (rng_state >> 7) & 0777777;
+}
+
+static void random_machine(unsigned long seed, struct FungusState *s)
+{
+    static const unsigned int deltas[] = {
+        0000001, 0000777, 0001000, 0777000
+    };
+    unsigned int x, y, r;
+
+    rng_state = (unsigned int)(seed * 2654435761u) ^ 0x9E3779B9u;
+    if (rng_state == 0) rng_state = 1;
+
+    for (x=0; x <= 0777; ++x)
+      for (y=0; y <= 0777; ++y)
+        s->memory[x][y] = random18();
+
+    s->regs[0] = 0;
+    for (r=1; r < 8; ++r)
+      s->regs[r] = random18();
+    /* Mostly walk in a straight line, as real programs do. */
+    if (random18() & 3)
+      s->regs[2] = deltas[random18() & 3];
+
+    /* Start in user mode half the time, with a random
+     * hardware context and OS security mask. */
+    s->hcon = s->hcor = s->osec = 0;
+    s->hcand = 0777777;
+    if (random18() & 1) {
+        s->hcon = 01000;
+        s->hcand = random18() | random18();
+        s->hcor = random18() & random18();
+        s->osec = random18() & random18();
+    }
+    s->istack = random18();
+    s->distk = 03000;  /* as set by initMachine() */
+    s->hi = random18();
+    s->dmasrc = random18();
+    s->dmadst = random18();
+    s->dmasize = random18() & 0037037;  /* keep transfers small */
+    s->cycle = 0;
+    s->retired = 0;
+
+    /* Arm some of the performance counters to overflow soon,
+     * to exercise the interrupt path. */
+    s->loads = s->stores = s->traps = s->ucycles = s->kcycles = 0;
+    s->pmcen = s->pmovf = s->pending = 0;
+    s->tlbidx = random18() & 7;
+    for (r=0; r < 8; ++r)
+      s->tlb[r] = r;
+    for (r=0; r < 6; ++r)
+      s->pmclimit[r] = 01000000;
+    if (random18() & 1) {
+        s->pmcen = random18() & 077;
+        for (r=0; r < 6; ++r)
+          s->pmclimit[r] = 1 + (random18() & 01777);
+    }
+
+    /* Now and then, map two pages to the same frame, and aim a block
+     * copy from one at a nearby spot in the other: the rectangles look
+     * disjoint, but share host columns. The copy is started from kernel
+     * mode by an SMR $0, #DMACTL ($0 is DMA_COPY) at the first cell
+     * executed, and more of them are scattered through memory. */
+    if ((random18() & 3) == 0) {
+        unsigned int px = (s->regs[1] + s->regs[2]) & 0777;
+        unsigned int py = ((s->regs[1] >> 9) + (s->regs[2] >> 9)) & 0777;
+        unsigned int p = random18() & 7;
+        unsigned int q = (p + 1 + random18() % 7) & 7;
+        unsigned int sx = p * 0100 + (random18() & 077);
+        unsigned int sy = random18() & 0777;
+        s->tlb[q] = s->tlb[p];
+        s->hcon = 0;
+        s->dmasrc = (sy << 9) | sx;
+        s->dmadst = (((sy + (random18() & 017) - 010) & 0777) << 9) |
+                    ((sx + (q - p) * 0100 + (random18() & 017) - 010) & 0777);
+        s->dmasize = ((1 + (random18() & 037)) << 9) | (020 + (random18() & 017));
+        for (r=0; r < 01000; ++r)
+          s->memory[random18() & 0777][random18() & 0777] = 0470147;
+        /* Either page's copy of the first cell may win on restore. */
+        s->memory[px][py] = 0470147;
+        s->memory[p * 0100 + (px & 077)][py] = 0470147;
+        s->memory[q * 0100 + (px & 077)][py] = 0470147;
+    }
+}
+
+
+/* Compare the live machine, as the engine under test left it,
+ * against the state the reference left it in. */
+static int compare_machine(const struct FungusState *ref,
+                           unsigned long xref, unsigned long xgot)
+{
+    static const char *regname[] = {
+        "$0", "$1", "$2", "$3", "$4", "$5", "$6", "$7"
+    };
+    int ok = 1;
+    int i, x, y;
+
+#define CHECK(got, field, name)                                     \
+    if ((got) != ref->field) {                                      \
+        printf("Mismatch: %s is %06o, should be %06o\n", name,      \
+            (unsigned int)(got), (unsigned int)ref->field);         \
+        ok = 0;                                                     \
+    }
+    for (i=0; i < 8; ++i)
+      CHECK(readReg(i), regs[i], regname[i]);
+    CHECK(peekMSR(040), hcon, "HCON");
+    CHECK(peekMSR(041), hcand, "HCAND");
+    CHECK(peekMSR(042), hcor, "HCOR");
+    CHECK(peekMSR(043), osec, "OSEC");
+    CHECK(peekMSR(050), istack, "ISTACK");
+    CHECK(peekMSR(051), distk, "DISTK");
+    CHECK(peekMSR(053), hi, "HI");
+    CHECK(peekMSR(044), dmasrc, "DMASRC");
+    CHECK(peekMSR(045), dmadst, "DMADST");
+    CHECK(peekMSR(046), dmasize, "DMASIZE");
+    CHECK(peekMSR(066), pmcen, "PMCEN");
+    CHECK(peekMSR(067), pmovf, "PMOVF");
+    CHECK(peekMSR(054), tlbidx, "TLBIDX");
+    CHECK(peekMSR(055), tlb[ref->tlbidx], "TLBENT");
+#undef CHECK
+
+    for (i=0; i < 6; ++i) {
+        const unsigned long events[6] = {
+            ref->retired, ref->loads, ref->stores,
+            ref->traps, ref->ucycles, ref->kcycles
+        };
+        unsigned int want = (events[i] - (ref->pmclimit[i] - 01000000)) & 0777777;
+        if (peekMSR(060+i) != want) {
+            printf("Mismatch: PMC%d is %06o, should be %06o\n", i,
+                peekMSR(060+i), want);
+            ok = 0;
+        }
+    }
+
+    if (cycle != ref->cycle) {
+        printf("Mismatch: cycle is %u, should be %u\n", cycle, ref->cycle);
+        ok = 0;
+    }
+    if (retired != ref->retired) {
+        printf("Mismatch: retired is %lu, should be %lu\n",
+            retired, ref->retired);
+        ok = 0;
+    }
+    if (xgot != xref) {
+        printf("Mismatch: %lu exceptions, should be %lu\n", xgot, xref);
+        ok = 0;
+    }
+    for (x=0; x <= 0777; ++x) {
+        if (memcmp((const void *)memory[x], ref->memory[x], sizeof ref->memory[x]) != 0) {
+            for (y=0; y <= 0777; ++y) {
+                if ((unsigned int)memory[x][y] != ref->memory[x][y]) {
+                    printf("Mismatch: memory (%03o,%03o) is %06o, should be %06o\n",
+                        x, y, (unsigned int)memory[x][y], ref->memory[x][y]);
+                    return 0;
+                }
+            }
+        }
+    }
+    return ok;
+}
+
+static void count_exception(unsigned int inst)
+{
+    (void)inst;
+    exceptions += 1;
+}
+
+
+static void do_error(const char *msg, ...)
+{
+    va_list ap;
+    va_start(ap, msg);
+    printf("Error: ");
+    vprintf(msg, ap);
+    putchar('\n');
+    va_end(ap);
+    exit(EXIT_FAILURE);
+}
+
+static void do_help(int man)
+{
+    puts("Usage: fungfuzz [-n programs] [-k blocks] [-b steps] [-s seed]");
+    puts("                [-e engine] [-v]");
+    if (man) {
+        puts("");
+        puts("  fungfuzz runs random programs on the reference step() and on");
+        puts("a faster execution engine in lockstep, and compares the whole");
+        puts("machine state after each block of steps. Each program is a");
+        puts("random memory image and register file, started in kernel or user");
+        puts("mode, and run for the given number of blocks (default 8) of the");
+        puts("given number of steps (default 512).");
+        puts("  Program n is generated from seed+n; to reproduce a mismatch,");
+        puts("run again with the reported seed and -n 1. fungfuzz exits with");
+        puts("status 1 if any program produced a mismatch.");
+        puts("  Engines:");
+        puts("    runFor    the simulator's run loop");
+    }
+    exit(EXIT_FAILURE);
+}
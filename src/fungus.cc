@@ -1,6 +1,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "fungus.h"
 #include "uint18.h"
 
@@ -10,11 +11,45 @@
 #define MSR_HCAND   041
 #define MSR_HCOR    042
 #define MSR_OSEC    043
+#define MSR_DMASRC  044  /* source corner, or the word to fill with */
+#define MSR_DMADST  045  /* destination corner */
+#define MSR_DMASIZE 046  /* (width, height) of the rectangle */
+#define MSR_DMACTL  047  /* write DMA_COPY or DMA_FILL to start */
 #define MSR_ISTACK  050
 #define MSR_DISTK   051
 #define MSR_IRET    052
+#define MSR_HI      053  /* high product or remainder from MUL, DIV */
+#define MSR_TLBIDX  054  /* which TLB entry MSR_TLBENT reads and writes */
+#define MSR_TLBENT  055  /* the frame mapped at that entry's page */
+#define MSR_PMC0    060  /* through 065; see PMC_* below */
+#define MSR_PMCEN   066
+#define MSR_PMOVF   067
 #define MSR_TICKS   070
 
+/* Performance-monitoring counters. */
+#define PMC_RETIRED 0
+#define PMC_LOADS   1
+#define PMC_STORES  2
+#define PMC_TRAPS   3
+#define PMC_UCYCLES 4
+#define PMC_KCYCLES 5
+#define NUM_PMCS    6
+#define PMC_IRQ     0     /* interrupt line for counter overflow */
+#define MAX_STEP_CYCLES 23  /* the most cycles one step() can take,
+                             * short of a DMA transfer */
+
+/* The DMA engine's commands and costs. */
+#define DMA_COPY    0
+#define DMA_FILL    1
+#define DMA_SETUP_CYCLES 8
+
+/* Bank-switched memory. The address space is divided into pages,
+ * each a band of PAGE_COLS columns, and each TLB entry maps one page
+ * to a frame of physical memory. */
+#define PAGE_COLS   0100
+#define NUM_PAGES   ((0777+1) / PAGE_COLS)
+#define MAX_FRAMES  01000
+
 int DebugPrint = 0;
 
 enum MaskingModes currentMode;
@@ -29,37 +64,107 @@ static uint18 HCON, HCAND, HCOR;  /* hardware context MSRs */
 static uint18 OSEC;       /* operating-system security MSR */
 static uint18 ISTACK;     /* async interrupt stack pointer */
 static uint18 DISTK;      /* async interrupt stack delta */
-uint18 memory[0777+1][0777+1];
+static uint18 HI;         /* the other half of a MUL or DIV result */
+static uint18 DMASRC, DMADST, DMASIZE;  /* DMA engine registers */
+uint18 *memory[0777+1];  /* columns of the mapped frames, indexed [x][y] */
+
+static uint18 plane0[0777+1][0777+1];  /* frames 0 to NUM_PAGES-1 */
+static uint18 *frames[MAX_FRAMES];
+static uint18 *fillColumns[MAX_FRAMES];  /* non-NULL: the frame is lazy */
+static unsigned int tlb[NUM_PAGES];   /* the frame mapped at each page */
+static bool lazyPage[NUM_PAGES];      /* the page maps a lazy frame */
+static unsigned int tlbIndex;
 
 unsigned int cycle;  /* hardware cycle counter */
+unsigned long retired;  /* instructions-retired counter */
+static bool modeChanged;  /* set whenever HCON might have changed, or
+                           * the run loop otherwise needs to look up */
+
+/* The performance counters are computed from the machine's own
+ * accounting. Each visible counter is 18 bits, and overflows when
+ * its event count reaches pmcLimit; so writing -N to a counter
+ * arms it to overflow after N more events. */
+static unsigned long loads, stores, traps;
+static unsigned long userCycles, kernelCycles;  /* as of modeStart */
+static unsigned int modeStart;
+static bool inUser;
+static unsigned long pmcLimit[NUM_PMCS];
+static unsigned int PMCEN;   /* bit n: counter n raises an interrupt */
+static unsigned int PMOVF;   /* bit n: counter n has overflowed */
+static unsigned int pendingIRQ;  /* bit n: interrupt line n is raised */
 
 
 extern "C" void run(void);
- extern "C" void step(void);
+extern "C" void runFor(unsigned int steps);
+ template <bool User> static unsigned int runMode(unsigned int steps);
+extern "C" void step(void);
+ template <bool User> static void stepMode(void);
   static void SetMaskingMode(int M);
-  static void group0(unsigned int inst);
-  static void group1(unsigned int inst);
+  template <bool User> static void hconfy(uint18 & x);
+  template <bool User> static void group0(unsigned int inst);
+  template <bool User> static void group1(unsigned int inst);
    static uint18 readMSR(int R);
    static void writeMSR(int R, uint18 value);
-  static uint18 nazg(int ALU, int A, int B);
-   static uint18 nazgUnary(int B, int A);
+  static uint18 nazg(int ALU, int A, int B, int X);
+   static uint18 nazgUnary(int B, int A, int X);
+    static uint18 shift(const uint18 & a, unsigned int count);
+   static uint18 multiply(const uint18 & a, const uint18 & b);
+   static uint18 divide(const uint18 & a, const uint18 & b);
   static void inspect(unsigned int X);
+ static unsigned int pmcBudget(unsigned int steps);
+  static unsigned long pmcEvents(int n);
+ static void pmcCheck(void);
+ static unsigned int pmcValue(int n);
+ static void pmcSet(int n, unsigned int value);
+ static void deliverInterrupt(void);
+ static void dmaStart(unsigned int command);
+  static bool spansOverlap(unsigned int a, unsigned int b, unsigned int n);
+  static bool columnsAlias(unsigned int sx, unsigned int dx, unsigned int w);
+static void modeSwitched(void);
 static void (*exceptionHandler)(unsigned int inst);
 static void UndefinedException(void);
 static void InfiniteLoopException(void);
 static void AssignToZeroException(void);
 static void async_interrupt(unsigned int where);
 static void async_iret(void);
+static void tlbReset(void);
+static void tlbMap(unsigned int page, unsigned int frame);
+static void tlbDropUnmapped(void);
+static void makeLazy(unsigned int frame, unsigned int value);
+ static void newFillColumn(unsigned int frame, unsigned int value);
+ static void remapFrame(unsigned int frame);
+static void materialize(unsigned int frame);
+static inline uint18 *columnForWrite(unsigned int x);
+static inline uint18 & cellForWrite(unsigned int x, unsigned int y);
+
+/* Memory must be mapped before initMachine(), since the loader
+ * writes the program into it first. */
+static struct TLBInit { TLBInit() { tlbReset(); } } tlbInit;
 
 extern "C" void initMachine(void)
 {
+    int n;
     HCON = uint18(0);
     HCAND = uint18(0777,0777);
     HCOR = uint18(0,0);
     OSEC = uint18(0);
     ISTACK = uint18(0,0);
     DISTK = uint18(0,3);
+    HI = uint18(0);
+    DMASRC = DMADST = DMASIZE = uint18(0);
+    tlbReset();
     cycle = 0;
+    retired = 0;
+    modeChanged = true;
+
+    loads = stores = traps = 0;
+    userCycles = kernelCycles = 0;
+    modeStart = 0;
+    inUser = false;
+    for (n=0; n < NUM_PMCS; ++n)
+      pmcLimit[n] = 01000000;
+    PMCEN = PMOVF = 0;
+    pendingIRQ = 0;
 }
 
 extern "C" void initRAM(const char *rambuffer, int width, int height)
@@ -73,8 +178,9 @@ extern "C" void initmem(const char *buffer, int sx, int sy, int width, int heigh
     int k = 0;
     for (j = sy; j < sy+height; ++j) {
         for (i = sx; i < sx+width; ++i) {
-            memory[i][j].setx(buffer[k++]);
-            memory[i][j].sety(0);
+            uint18 & cell = cellForWrite(i & 0777, j & 0777);
+            cell.setx(buffer[k++]);
+            cell.sety(0);
         }
     }
 }
@@ -90,21 +196,63 @@ extern "C" void initmemw(const unsigned int *buffer, int sx, int sy, int width,
     int k = 0;
     for (j = sy; j < sy+height; ++j)
       for (i = sx; i < sx+width; ++i)
-        memory[i][j] = uint18(buffer[k++]);
+        cellForWrite(i & 0777, j & 0777) = uint18(buffer[k++]);
 }
 
 
 extern "C" void run(void)
 {
     while (1)
-      step();
+      runFor(~0u);
+}
+
+/* Kernel mode and user mode each get their own copy of the inner loop,
+ * with every check of HCON resolved at compile time. We switch loops
+ * only when an instruction might have changed HCON; that is, on TRP,
+ * RET, an asynchronous interrupt, or IRET.
+ *   The performance counters cost nothing per instruction: when any
+ * are armed, we run only as many steps at a time as can't possibly
+ * overflow one, and check them between runs. */
+extern "C" void runFor(unsigned int steps)
+{
+    while (steps != 0) {
+        unsigned int chunk = PMCEN ? pmcBudget(steps) : steps;
+        unsigned int left = HCON ? runMode<true>(chunk) : runMode<false>(chunk);
+        steps -= chunk - left;
+        if (PMCEN)
+          pmcCheck();
+        if (pendingIRQ && HCON)
+          deliverInterrupt();
+    }
+}
+
+template <bool User>
+static unsigned int runMode(unsigned int steps)
+{
+    modeChanged = false;
+    do {
+        --steps;
+        stepMode<User>();
+    } while (steps != 0 && !modeChanged);
+    return steps;
 }
 
 extern "C" void step(void)
+{
+    if (HCON) stepMode<true>();
+    else stepMode<false>();
+    if (PMCEN)
+      pmcCheck();
+    if (pendingIRQ && HCON)
+      deliverInterrupt();
+}
+
+template <bool User>
+static void stepMode(void)
 {
     currentMode = MaskVector;
     PC += DeltaPC;  /* increment the PC */
-    if (HCON) PC = (PC & HCAND) | HCOR;
+    hconfy<User>(PC);
 
     unsigned int inst = (unsigned int)memory[PC.getx()][PC.gety()];
     int G = (inst >> 17) & 01;
@@ -118,11 +266,13 @@ extern "C" void step(void)
             (inst>>9)&0777, (inst & 0777), disasm(inst));
     }
 
+    retired += 1;
     int OSEC_mask = (G << 3) | OP;
-    if (HCON && ((unsigned int)OSEC & (1 << OSEC_mask)))
-      async_interrupt(0777);
-    else
-      (G ? group1 : group0)(inst);
+    if (User && ((unsigned int)OSEC & (1 << OSEC_mask))) {
+        traps += 1;
+        async_interrupt(0777);
+    } else
+      (G ? group1<User> : group0<User>)(inst);
 }
 
 static void SetMaskingMode(int M)
@@ -145,6 +295,15 @@ static void hconfy(uint18 & x)
     }
 }
 
+/* The same, for code that knows which mode it's in. In MaskVector
+ * mode, & and | are just the bitwise operators. */
+template <bool User>
+static void hconfy(uint18 & x)
+{
+    if (User)
+      x = uint18(((unsigned int)x & (unsigned int)HCAND) | (unsigned int)HCOR);
+}
+
 
 static void async_interrupt(unsigned int where)
 {
@@ -156,17 +315,18 @@ static void async_interrupt(unsigned int where)
     iy += dy;
     ISTACK = uint18(iy, ix);
     HCON.sety(0);
-    memory[ix-1 & 0777][iy-1 & 0777] = register_file[1];
-    memory[ix+0 & 0777][iy-1 & 0777] = register_file[2];
-    memory[ix-1 & 0777][iy+0 & 0777] = register_file[3];
-    memory[ix+0 & 0777][iy+0 & 0777] = register_file[4];
-    memory[ix+1 & 0777][iy+0 & 0777] = register_file[5];
-    memory[ix+0 & 0777][iy+1 & 0777] = register_file[6];
-    memory[ix+1 & 0777][iy+1 & 0777] = register_file[7];
+    cellForWrite(ix-1 & 0777, iy-1 & 0777) = register_file[1];
+    cellForWrite(ix+0 & 0777, iy-1 & 0777) = register_file[2];
+    cellForWrite(ix-1 & 0777, iy+0 & 0777) = register_file[3];
+    cellForWrite(ix+0 & 0777, iy+0 & 0777) = register_file[4];
+    cellForWrite(ix+1 & 0777, iy+0 & 0777) = register_file[5];
+    cellForWrite(ix+0 & 0777, iy+1 & 0777) = register_file[6];
+    cellForWrite(ix+1 & 0777, iy+1 & 0777) = register_file[7];
     TPC = PC; TDeltaPC = DeltaPC;
     PC = uint18(0777, where);
     DeltaPC = uint18(-1,0);
     cycle += 12;
+    modeSwitched();
 }
 
 static void async_iret(void)
@@ -188,9 +348,44 @@ static void async_iret(void)
     ISTACK = uint18(iy, ix);
     HCON.sety(1);
     cycle += 8;
+    modeSwitched();
 }
 
 
+/* Called whenever HCON might have changed. Charges the cycles since
+ * the last switch to the mode we were in, including those of the
+ * instruction that switched, and makes the run loops redispatch. */
+static void modeSwitched(void)
+{
+    if (inUser)
+      userCycles += cycle - modeStart;
+    else
+      kernelCycles += cycle - modeStart;
+    modeStart = cycle;
+    inUser = (bool)HCON;
+    modeChanged = true;
+}
+
+/* Interrupt line n vectors to (0777, 0776-n). Interrupts are taken
+ * only in user mode; in kernel mode they wait until the kernel returns
+ * to user mode, and the lowest-numbered line goes first. */
+extern "C" void raiseInterrupt(unsigned int line)
+{
+    pendingIRQ |= (1u << (line & 037));
+    modeChanged = true;
+}
+
+static void deliverInterrupt(void)
+{
+    unsigned int n = 0;
+    while (!(pendingIRQ & (1u << n)))
+      ++n;
+    pendingIRQ &= ~(1u << n);
+    async_interrupt(0776 - n);
+}
+
+
+template <bool User>
 static void group0(unsigned int inst)
 {
     unsigned int OP = (inst >> 12) & 07;
@@ -205,6 +400,8 @@ static void group0(unsigned int inst)
             PC = uint18(L,0);
             DeltaPC = uint18(0,-1);
             cycle += 8;
+            traps += 1;
+            modeSwitched();
             break;
         }
         case 1: {  /* LI, 0mm 001 xxx LLLLLLLLL */
@@ -212,7 +409,7 @@ static void group0(unsigned int inst)
               AssignToZeroException();
             register_file[X].setm(uint18(L,0));
             if (X == 1)
-              hconfy(PC);
+              hconfy<User>(PC);
             cycle += 4;
             break;
         }
@@ -221,7 +418,7 @@ static void group0(unsigned int inst)
               AssignToZeroException();
             register_file[X].setm(uint18(L,L));
             if (X == 1)
-              hconfy(PC);
+              hconfy<User>(PC);
             cycle += 4;
             break;
         }
@@ -238,7 +435,7 @@ static void group0(unsigned int inst)
             if (!cc) {
                 currentMode = MaskVector;
                 PC += DeltaPC;
-                hconfy(PC);
+                hconfy<User>(PC);
                 cycle += 7;
             } else {
                 cycle += 6;
@@ -254,7 +451,7 @@ static void group0(unsigned int inst)
             if (cc) {
                 currentMode = MaskVector;
                 PC += DeltaPC;
-                hconfy(PC);
+                hconfy<User>(PC);
                 cycle += 7;
             } else {
                 cycle += 6;
@@ -289,6 +486,7 @@ static void group0(unsigned int inst)
             DeltaPC = TDeltaPC;
             HCON.sety(1);
             cycle += 5;
+            modeSwitched();
             inspect(1);
             inspect(2);
             break;
@@ -296,6 +494,7 @@ static void group0(unsigned int inst)
     }
 }
 
+template <bool User>
 static void group1(unsigned int inst)
 {
     unsigned int OP = (inst >> 12) & 07;
@@ -306,63 +505,69 @@ static void group1(unsigned int inst)
     switch (OP) {
         case 0: {  /* ALU instructions */
             uint18 old_x = register_file[X];
-            register_file[X].setm(nazg(ALU, A, B));
+            register_file[X].setm(nazg(ALU, A, B, X));
             if (X == 1)
-              hconfy(PC);
+              hconfy<User>(PC);
             if (register_file[X] != old_x)
               inspect(X);
             cycle += 4;
             break;
         }
         case 1: {  /* LW */
-            uint18 temp = nazg(ALU, A, B);
-            hconfy(temp);
+            uint18 temp = nazg(ALU, A, B, X);
+            hconfy<User>(temp);
             register_file[X] = memory[temp.getx()][temp.gety()];
             if (X == 1)
-              hconfy(PC);
+              hconfy<User>(PC);
             inspect(X);
             cycle += 5;
+            loads += 1;
             break;
         }
         case 2: {  /* LX */
-            uint18 temp = nazg(ALU, A, B);
-            hconfy(temp);
+            uint18 temp = nazg(ALU, A, B, X);
+            hconfy<User>(temp);
             register_file[X].setx(memory[temp.getx()][temp.gety()].getx());
             if (X == 1)
-              hconfy(PC);
+              hconfy<User>(PC);
             inspect(X);
             cycle += 5;
+            loads += 1;
             break;
         }
         case 3: {  /* LY */
-            uint18 temp = nazg(ALU, A, B);
-            hconfy(temp);
+            uint18 temp = nazg(ALU, A, B, X);
+            hconfy<User>(temp);
             register_file[X].sety(memory[temp.getx()][temp.gety()].gety());
             if (X == 1)
-              hconfy(PC);
+              hconfy<User>(PC);
             inspect(X);
             cycle += 5;
+            loads += 1;
             break;
         }
         case 4: {  /* SW */
-            uint18 temp = nazg(ALU, A, B);
-            hconfy(temp);
-            memory[temp.getx()][temp.gety()] = register_file[X];
+            uint18 temp = nazg(ALU, A, B, X);
+            hconfy<User>(temp);
+            cellForWrite(temp.getx(), temp.gety()) = register_file[X];
             cycle += 5;
+            stores += 1;
             break;
         }
         case 5: {  /* SX */
-            uint18 temp = nazg(ALU, A, B);
-            hconfy(temp);
-            memory[temp.getx()][temp.gety()].setx(register_file[X].getx());
+            uint18 temp = nazg(ALU, A, B, X);
+            hconfy<User>(temp);
+            cellForWrite(temp.getx(), temp.gety()).setx(register_file[X].getx());
             cycle += 5;
+            stores += 1;
             break;
         }
         case 6: {  /* SY */
-            uint18 temp = nazg(ALU, A, B);
-            hconfy(temp);
-            memory[temp.getx()][temp.gety()].sety(register_file[X].gety());
+            uint18 temp = nazg(ALU, A, B, X);
+            hconfy<User>(temp);
+            cellForWrite(temp.getx(), temp.gety()).sety(register_file[X].gety());
             cycle += 5;
+            stores += 1;
             break;
         }
         case 7: {  /* undefined by the official spec: LMR, SMR */
@@ -371,7 +576,7 @@ static void group1(unsigned int inst)
                     uint18 temp = readMSR(inst & 077);
                     register_file[X].setm(temp);
                     if (X == 1)
-                      hconfy(PC);
+                      hconfy<User>(PC);
                     inspect(X);
                     cycle += 4;
                     break;
@@ -392,7 +597,7 @@ static void group1(unsigned int inst)
       AssignToZeroException();
 }
 
-static uint18 nazg(int ALU, int A, int B)
+static uint18 nazg(int ALU, int A, int B, int X)
 {
     switch (ALU) {
         case 0:
@@ -406,18 +611,16 @@ static uint18 nazg(int ALU, int A, int B)
         case 4:
             return register_file[A] ^ register_file[B];
         case 5:
-            UndefinedException();
-            break;
+            return multiply(register_file[A], register_file[B]);
         case 6:
-            UndefinedException();
-            break;
+            return divide(register_file[A], register_file[B]);
         case 7:
-            return nazgUnary(B, A);
+            return nazgUnary(B, A, X);
     }
     return uint18(0);  // NOTREACHED
 }
 
-static uint18 nazgUnary(int B, int A)
+static uint18 nazgUnary(int B, int A, int X)
 {
     switch (B) {
         case 0:
@@ -433,13 +636,60 @@ static uint18 nazgUnary(int B, int A)
         case 5:
             return register_file[A] - uint18(1);
         case 6:
+            return shift(register_file[A], register_file[X].getx());
         case 7:
-            UndefinedException();
-            break;
+            return uint18(register_file[A].gety(), register_file[A].getx());
     }
     return uint18(0773, 0440);  /* a suitable magic number */
 }
 
+/* SHF shifts $A by the x lane of $X, read as a signed 9-bit count:
+ * positive counts shift left and negative counts shift right. Each
+ * lane shifts separately, except in scalar mode. */
+static uint18 shift(const uint18 & a, unsigned int count)
+{
+    if (count & 0400) {
+        count = 01000 - count;
+        return a >> (count < 18 ? count : 18);
+    }
+    return a << (count < 18 ? count : 18);
+}
+
+/* MUL leaves the low half of the product in $X and the high half in
+ * the HI MSR. In the vector modes each lane is a separate 9-bit
+ * multiply; in scalar mode the product is 36 bits. The extra cycles
+ * are charged here, since an address can be computed this way too. */
+static uint18 multiply(const uint18 & a, const uint18 & b)
+{
+    if (currentMode == MaskScalar) {
+        unsigned long long p = (unsigned long long)(unsigned int)a * (unsigned int)b;
+        HI = uint18((unsigned int)(p >> 18) & 0777777);
+        cycle += 4;
+    } else {
+        HI.setm((a.getx() * b.getx()) >> 9, (a.gety() * b.gety()) >> 9);
+        cycle += 2;
+    }
+    return a * b;
+}
+
+/* DIV leaves the quotient in $X and the remainder in HI. Dividing
+ * by zero gives a quotient of all ones and leaves the dividend as
+ * the remainder, so that it never traps. */
+static uint18 divide(const uint18 & a, const uint18 & b)
+{
+    if (currentMode == MaskScalar) {
+        unsigned int n = a, d = b;
+        HI = uint18(d ? n % d : n);
+        cycle += 18;
+    } else {
+        unsigned int nx = a.getx(), dx = b.getx();
+        unsigned int ny = a.gety(), dy = b.gety();
+        HI.setm(dx ? nx % dx : nx, dy ? ny % dy : ny);
+        cycle += 9;
+    }
+    return a / b;
+}
+
 
 static void inspect(unsigned int X)
 {
@@ -482,8 +732,27 @@ uint18 readMSR(int reg)
             return uint18(cycle);
         case MSR_IRET:
             return uint18(0);
+        case MSR_HI:
+            return HI;
+        case MSR_DMASRC:
+            return DMASRC;
+        case MSR_DMADST:
+            return DMADST;
+        case MSR_DMASIZE:
+            return DMASIZE;
+        case MSR_TLBIDX:
+            return uint18(tlbIndex);
+        case MSR_TLBENT:
+            return uint18(tlb[tlbIndex]);
         case MSR_ISTACK:
             return ISTACK;
+        case MSR_PMC0+0: case MSR_PMC0+1: case MSR_PMC0+2:
+        case MSR_PMC0+3: case MSR_PMC0+4: case MSR_PMC0+5:
+            return uint18(pmcValue(reg - MSR_PMC0));
+        case MSR_PMCEN:
+            return uint18(PMCEN);
+        case MSR_PMOVF:
+            return uint18(PMOVF);
         default:
             return uint18(0);
     }
@@ -517,12 +786,399 @@ void writeMSR(int reg, uint18 value)
         case MSR_IRET:
             async_iret();
             return;
+        case MSR_HI:
+            HI.setm(value);
+            return;
+        case MSR_DMASRC:
+            if (!HCON)
+              DMASRC.setm(value);
+            return; /* The DMA engine is usable only in kernel mode. */
+        case MSR_DMADST:
+            if (!HCON)
+              DMADST.setm(value);
+            return;
+        case MSR_DMASIZE:
+            if (!HCON)
+              DMASIZE.setm(value);
+            return;
+        case MSR_DMACTL:
+            if (!HCON)
+              dmaStart((unsigned int)value);
+            return;
+        case MSR_TLBIDX:
+            if (!HCON)
+              tlbIndex = (unsigned int)value & (NUM_PAGES - 1);
+            return; /* The TLB is writeable only in kernel mode. */
+        case MSR_TLBENT:
+            if (!HCON)
+              tlbMap(tlbIndex, (unsigned int)value & (MAX_FRAMES - 1));
+            return;
+        case MSR_PMC0+0: case MSR_PMC0+1: case MSR_PMC0+2:
+        case MSR_PMC0+3: case MSR_PMC0+4: case MSR_PMC0+5:
+            if (!HCON) {
+                uint18 temp(pmcValue(reg - MSR_PMC0));
+                temp.setm(value);
+                pmcSet(reg - MSR_PMC0, (unsigned int)temp);
+            }
+            return; /* The PMU is writeable only in kernel mode. */
+        case MSR_PMCEN:
+            if (!HCON) {
+                uint18 temp(PMCEN);
+                temp.setm(value);
+                PMCEN = (unsigned int)temp & ((1u << NUM_PMCS) - 1);
+                modeChanged = true;
+            }
+            return;
+        case MSR_PMOVF:
+            if (!HCON) {
+                uint18 temp(PMOVF);
+                temp.setm(value);
+                PMOVF = (unsigned int)temp & ((1u << NUM_PMCS) - 1);
+            }
+            return;
         default:
             return;
     }
 }
 
 
+/********************* Performance-monitoring counters. *********************/
+
+
+static unsigned long pmcEvents(int n)
+{
+    switch (n) {
+        case PMC_RETIRED: return retired;
+        case PMC_LOADS: return loads;
+        case PMC_STORES: return stores;
+        case PMC_TRAPS: return traps;
+        case PMC_UCYCLES: return userCycles + (inUser ? cycle - modeStart : 0);
+        case PMC_KCYCLES: return kernelCycles + (inUser ? 0 : cycle - modeStart);
+    }
+    return 0;
+}
+
+static unsigned int pmcValue(int n)
+{
+    return (pmcEvents(n) - (pmcLimit[n] - 01000000)) & 0777777;
+}
+
+static void pmcSet(int n, unsigned int value)
+{
+    pmcLimit[n] = pmcEvents(n) + 01000000 - (value & 0777777);
+    modeChanged = true;  /* runFor() must recompute its budget */
+}
+
+/* How many steps can we take before any armed counter might overflow?
+ * A step is at most one event of each kind except cycles, of which it
+ * can be up to MAX_STEP_CYCLES. */
+static unsigned int pmcBudget(unsigned int steps)
+{
+    int n;
+    for (n=0; n < NUM_PMCS; ++n) {
+        unsigned long events, left;
+        if (!(PMCEN & (1u << n))) continue;
+        events = pmcEvents(n);
+        left = (events < pmcLimit[n]) ? pmcLimit[n] - events : 0;
+        if (n == PMC_UCYCLES || n == PMC_KCYCLES)
+          left /= MAX_STEP_CYCLES;
+        if (left < 1) left = 1;
+        if (left < steps) steps = left;
+    }
+    return steps;
+}
+
+static void pmcCheck(void)
+{
+    int n;
+    for (n=0; n < NUM_PMCS; ++n) {
+        unsigned long events;
+        if (!(PMCEN & (1u << n))) continue;
+        events = pmcEvents(n);
+        if (events >= pmcLimit[n]) {
+            while (events >= pmcLimit[n])
+              pmcLimit[n] += 01000000;
+            PMOVF |= (1u << n);
+            raiseInterrupt(PMC_IRQ);
+        }
+    }
+}
+
+
+/********************* Block-copy and block-fill DMA. ***********************/
+
+
+/* A transfer moves or fills the DMASIZE rectangle, wrapping around the
+ * edges of memory like everything else, and completes before the SMR
+ * that started it retires. Its cost is charged to that one SMR, which
+ * can blow well past MAX_STEP_CYCLES; so the run loop must look up
+ * afterward, to catch any cycle counter the transfer overflowed. */
+static void dmaStart(unsigned int command)
+{
+    static unsigned int staging[0777+1][0777+1];
+    unsigned int w = DMASIZE.getx(), h = DMASIZE.gety();
+    unsigned int sx = DMASRC.getx(), sy = DMASRC.gety();
+    unsigned int dx = DMADST.getx(), dy = DMADST.gety();
+    unsigned int i, j;
+    /* uint18 is laid out exactly like an unsigned int. */
+    unsigned int **mem = (unsigned int **)memory;
+
+    if (command == DMA_FILL) {
+        unsigned int word = (unsigned int)DMASRC;
+        for (i=0; i < w; ++i) {
+            unsigned int *col = (unsigned int *)columnForWrite((dx+i) & 0777);
+            for (j=0; j < h; ++j)
+              col[(dy+j) & 0777] = word;
+        }
+        cycle += DMA_SETUP_CYCLES + (w*h + 1) / 2;
+    } else if (command == DMA_COPY) {
+        /* Each column of the rectangle is contiguous in memory, apart
+         * from wrapping; the common case is a straight memcpy per
+         * column. Overlapping rectangles go through a staging copy.
+         * Pages can share a frame, so overlap is a matter of host
+         * columns, not addresses; and materializing the destination
+         * can move the source's columns, so that comes first. */
+        for (i=0; i < w; ++i)
+          columnForWrite((dx+i) & 0777);
+        bool overlap = spansOverlap(sy, dy, h) && columnsAlias(sx, dx, w);
+        bool wraps = (sy + h > 01000) || (dy + h > 01000);
+        if (overlap) {
+            for (i=0; i < w; ++i)
+              for (j=0; j < h; ++j)
+                staging[i][j] = mem[(sx+i) & 0777][(sy+j) & 0777];
+            for (i=0; i < w; ++i)
+              for (j=0; j < h; ++j)
+                cellForWrite((dx+i) & 0777, (dy+j) & 0777) = uint18(staging[i][j]);
+        } else if (!wraps) {
+            for (i=0; i < w; ++i)
+              memcpy(mem[(dx+i) & 0777] + dy, mem[(sx+i) & 0777] + sy, h * sizeof **mem);
+        } else {
+            for (i=0; i < w; ++i) {
+                unsigned int *dst = mem[(dx+i) & 0777];
+                unsigned int *src = mem[(sx+i) & 0777];
+                for (j=0; j < h; ++j)
+                  dst[(dy+j) & 0777] = src[(sy+j) & 0777];
+            }
+        }
+        cycle += DMA_SETUP_CYCLES + w*h;
+    } else {
+        UndefinedException();
+        return;
+    }
+    modeChanged = true;
+}
+
+/* Do the wrapped spans [a, a+n) and [b, b+n) have any cell in common? */
+static bool spansOverlap(unsigned int a, unsigned int b, unsigned int n)
+{
+    return ((b - a) & 0777) < n || ((a - b) & 0777) < n;
+}
+
+/* Does any of the w columns from sx share a host column with any of
+ * the w columns from dx? Only a column at the same offset in some page
+ * can, when the two pages map the same frame (or it's the same page). */
+static bool columnsAlias(unsigned int sx, unsigned int dx, unsigned int w)
+{
+    unsigned int i, page;
+    for (i=0; i < w; ++i) {
+        unsigned int x = (sx+i) & 0777;
+        for (page=0; page < NUM_PAGES; ++page) {
+            unsigned int col = page * PAGE_COLS + x % PAGE_COLS;
+            if (((col - dx) & 0777) < w && memory[col] == memory[x])
+              return true;
+        }
+    }
+    return false;
+}
+
+
+/******************* Bank-switched memory and the TLB. **********************/
+
+
+/* The TLB is loaded entirely by software: the kernel picks an entry
+ * with MSR_TLBIDX and writes a frame number to MSR_TLBENT, and from
+ * the next instruction on, that page of the address space is the new
+ * frame. The host side is just a table of column pointers, so a remap
+ * swaps PAGE_COLS pointers and copies nothing. Frames past the first
+ * plane start out lazy, as all zeroes, when they are first mapped. */
+static void tlbMap(unsigned int page, unsigned int frame)
+{
+    unsigned int c;
+    if (frames[frame] == NULL && fillColumns[frame] == NULL)
+      newFillColumn(frame, 0);
+    tlb[page] = frame;
+    lazyPage[page] = (fillColumns[frame] != NULL);
+    for (c=0; c < PAGE_COLS; ++c) {
+        memory[page * PAGE_COLS + c] = lazyPage[page]? fillColumns[frame]:
+                                       frames[frame] + c * (0777+1);
+    }
+}
+
+/* Map each page to the frame of the same number, in the first plane,
+ * and let go of every other frame. */
+static void tlbReset(void)
+{
+    unsigned int p;
+    for (p=0; p < NUM_PAGES; ++p) {
+        if (frames[p] == NULL)
+          frames[p] = plane0[p * PAGE_COLS];
+        tlbMap(p, p);
+    }
+    tlbIndex = 0;
+    tlbDropUnmapped();
+}
+
+/* A snapshot holds only the mapped frames; so that restoring one is
+ * deterministic, every frame not mapped is released, or cleared if
+ * it belongs to the first plane. */
+static void tlbDropUnmapped(void)
+{
+    bool mapped[MAX_FRAMES] = { false };
+    unsigned int p, f;
+    for (p=0; p < NUM_PAGES; ++p)
+      mapped[tlb[p]] = true;
+    for (f=0; f < MAX_FRAMES; ++f) {
+        if (mapped[f]) continue;
+        free(fillColumns[f]);
+        fillColumns[f] = NULL;
+        if (frames[f] == NULL) continue;
+        if (f < NUM_PAGES) {
+            memset((void *)frames[f], 0, PAGE_COLS * (0777+1) * sizeof (uint18));
+        } else {
+            free(frames[f]);
+            frames[f] = NULL;
+        }
+    }
+}
+
+
+/* A lazy frame hasn't been written since it was last filled; every
+ * column of it is the same, and is kept just once, as its fill column.
+ * A page mapping a lazy frame points all its columns at the fill
+ * column, so reads see the right values without any checks at all;
+ * only stores have to look, and materialize the frame before they
+ * write to it. Loading a program fills the whole address space, and
+ * most of that fill is never written again. */
+static void makeLazy(unsigned int frame, unsigned int value)
+{
+    free(fillColumns[frame]);
+    fillColumns[frame] = NULL;
+    newFillColumn(frame, value);
+    remapFrame(frame);
+}
+
+static void newFillColumn(unsigned int frame, unsigned int value)
+{
+    unsigned int j;
+    fillColumns[frame] = (uint18 *)malloc((0777+1) * sizeof (uint18));
+    if (fillColumns[frame] == NULL) {
+        printf("Out of memory for frame %03o\n", frame);
+        exit(EXIT_FAILURE);
+    }
+    for (j=0; j <= 0777; ++j)
+      fillColumns[frame][j] = uint18(value);
+}
+
+static void remapFrame(unsigned int frame)
+{
+    unsigned int p;
+    for (p=0; p < NUM_PAGES; ++p)
+      if (tlb[p] == frame) tlbMap(p, frame);
+}
+
+/* Give a lazy frame real storage, with every column a copy of its
+ * fill column. The first plane's frames always have storage. */
+static void materialize(unsigned int frame)
+{
+    unsigned int c;
+    if (frames[frame] == NULL) {
+        frames[frame] = (uint18 *)malloc(PAGE_COLS * (0777+1) * sizeof (uint18));
+        if (frames[frame] == NULL) {
+            printf("Out of memory for frame %03o\n", frame);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (c=0; c < PAGE_COLS; ++c) {
+        memcpy((void *)(frames[frame] + c * (0777+1)),
+               (const void *)fillColumns[frame], (0777+1) * sizeof (uint18));
+    }
+    free(fillColumns[frame]);
+    fillColumns[frame] = NULL;
+    remapFrame(frame);
+}
+
+static inline uint18 *columnForWrite(unsigned int x)
+{
+    if (lazyPage[x / PAGE_COLS])
+      materialize(tlb[x / PAGE_COLS]);
+    return memory[x];
+}
+
+static inline uint18 & cellForWrite(unsigned int x, unsigned int y)
+{
+    return columnForWrite(x)[y];
+}
+
+/* Back whole pages of memory with the caller's storage, laid out just
+ * like memory, column after column, rather than copying it in: a
+ * loader can map an image file there, and pay for each page only when
+ * it's touched. The storage takes the place of the first plane's frames
+ * the pages map, and must outlive the machine. The words aren't checked,
+ * since that would touch every page: the image format keeps their top
+ * bits zero, and a stray one can't reach outside memory anyway, because
+ * every access masks its coordinates. Returns -1, and changes nothing,
+ * unless the columns are whole pages mapping the first plane. */
+extern "C" int attachmem(unsigned int sx, unsigned int ncols, unsigned int *cells)
+{
+    unsigned int i;
+    if (sx % PAGE_COLS != 0 || ncols % PAGE_COLS != 0 || sx + ncols > 0777+1)
+      return -1;
+    for (i=sx; i < sx + ncols; i += PAGE_COLS)
+      if (tlb[i / PAGE_COLS] >= NUM_PAGES) return -1;
+    for (i=0; i < ncols; i += PAGE_COLS) {
+        unsigned int frame = tlb[(sx+i) / PAGE_COLS];
+        frames[frame] = (uint18 *)(cells + i * (0777+1));
+        free(fillColumns[frame]);
+        fillColumns[frame] = NULL;
+        remapFrame(frame);
+    }
+    return 0;
+}
+
+/* Fill a rectangle of memory with one value, as the loader does for
+ * global fills and BSS sections. Where the rectangle covers whole
+ * pages, nothing is written: the pages' frames become lazy, or if
+ * they're lazy already, their fill columns get the new rows. */
+extern "C" void fillmem(unsigned int sx, unsigned int sy,
+                        unsigned int width, unsigned int height,
+                        unsigned int value)
+{
+    unsigned int i, j;
+    uint18 v = uint18(value & 0777777);
+    if (width > 0777+1) width = 0777+1;
+    if (height > 0777+1) height = 0777+1;
+    for (i=0; i < width; ++i) {
+        unsigned int x = (sx+i) & 0777;
+        unsigned int page = x / PAGE_COLS;
+        uint18 *col;
+        if (x % PAGE_COLS == 0 && width - i >= PAGE_COLS &&
+            (height == 0777+1 || lazyPage[page])) {
+            if (height == 0777+1) {
+                makeLazy(tlb[page], value & 0777777);
+            } else {
+                for (j=0; j < height; ++j)
+                  fillColumns[tlb[page]][(sy+j) & 0777] = v;
+            }
+            i += PAGE_COLS - 1;
+            continue;
+        }
+        col = columnForWrite(x);
+        for (j=0; j < height; ++j)
+          col[(sy+j) & 0777] = v;
+    }
+}
+
+
 /********* Exception-handling functions and callback registry. **************/
 
 extern "C" void onException(void (*ex)(unsigned int))
@@ -563,7 +1219,7 @@ static void AssignToZeroException(void)
 
 
 extern "C" void setmem(unsigned int x, unsigned int y, unsigned int value)
-{ memory[x&0777][y&0777] = uint18(value); }
+{ cellForWrite(x&0777, y&0777) = uint18(value); }
 
 extern "C" unsigned int readmem(unsigned int x, unsigned int y)
 { return (unsigned int)memory[x&0777][y&0777]; }
@@ -574,3 +1230,127 @@ extern "C" void setReg(unsigned int which, unsigned int value)
 extern "C" unsigned int readReg(unsigned int which)
 { return (unsigned int)register_file[which&7]; }
 
+
+extern "C" unsigned int peekMSR(unsigned int msr)
+{
+    switch (msr & 077) {
+        case MSR_HCON: return (unsigned int)HCON;
+        case MSR_HCAND: return (unsigned int)HCAND;
+        case MSR_HCOR: return (unsigned int)HCOR;
+        case MSR_OSEC: return (unsigned int)OSEC;
+        case MSR_ISTACK: return (unsigned int)ISTACK;
+        case MSR_DISTK: return (unsigned int)DISTK;
+        case MSR_HI: return (unsigned int)HI;
+        case MSR_DMASRC: return (unsigned int)DMASRC;
+        case MSR_DMADST: return (unsigned int)DMADST;
+        case MSR_DMASIZE: return (unsigned int)DMASIZE;
+        case MSR_TLBIDX: return tlbIndex;
+        case MSR_TLBENT: return tlb[tlbIndex];
+        case MSR_TICKS: return cycle;
+        case MSR_PMC0+0: case MSR_PMC0+1: case MSR_PMC0+2:
+        case MSR_PMC0+3: case MSR_PMC0+4: case MSR_PMC0+5:
+            return pmcValue((msr & 077) - MSR_PMC0);
+        case MSR_PMCEN: return PMCEN;
+        case MSR_PMOVF: return PMOVF;
+        default: return 0;
+    }
+}
+
+extern "C" void pokeMSR(unsigned int msr, unsigned int value)
+{
+    switch (msr & 077) {
+        case MSR_HCON: HCON = uint18(value & 0777777); modeSwitched(); break;
+        case MSR_HCAND: HCAND = uint18(value & 0777777); break;
+        case MSR_HCOR: HCOR = uint18(value & 0777777); break;
+        case MSR_OSEC: OSEC = uint18(value & 0777777); break;
+        case MSR_ISTACK: ISTACK = uint18(value & 0777777); break;
+        case MSR_DISTK: DISTK = uint18(value & 0777777); break;
+        case MSR_HI: HI = uint18(value & 0777777); break;
+        case MSR_DMASRC: DMASRC = uint18(value & 0777777); break;
+        case MSR_DMADST: DMADST = uint18(value & 0777777); break;
+        case MSR_DMASIZE: DMASIZE = uint18(value & 0777777); break;
+        case MSR_TLBIDX: tlbIndex = value & (NUM_PAGES - 1); break;
+        case MSR_TLBENT: tlbMap(tlbIndex, value & (MAX_FRAMES - 1)); break;
+        case MSR_TICKS: modeSwitched(); cycle = modeStart = value; break;
+        case MSR_PMC0+0: case MSR_PMC0+1: case MSR_PMC0+2:
+        case MSR_PMC0+3: case MSR_PMC0+4: case MSR_PMC0+5:
+            pmcSet((msr & 077) - MSR_PMC0, value);
+            break;
+        case MSR_PMCEN: PMCEN = value & ((1u << NUM_PMCS) - 1); modeChanged = true; break;
+        case MSR_PMOVF: PMOVF = value & ((1u << NUM_PMCS) - 1); break;
+    }
+}
+
+
+extern "C" void saveMachine(struct FungusState *s)
+{
+    int i;
+    for (i=0; i < 8; ++i)
+      s->regs[i] = (unsigned int)register_file[i];
+    s->hcon = (unsigned int)HCON;
+    s->hcand = (unsigned int)HCAND;
+    s->hcor = (unsigned int)HCOR;
+    s->osec = (unsigned int)OSEC;
+    s->istack = (unsigned int)ISTACK;
+    s->distk = (unsigned int)DISTK;
+    s->hi = (unsigned int)HI;
+    s->dmasrc = (unsigned int)DMASRC;
+    s->dmadst = (unsigned int)DMADST;
+    s->dmasize = (unsigned int)DMASIZE;
+    s->cycle = cycle;
+    s->retired = retired;
+    s->loads = loads;
+    s->stores = stores;
+    s->traps = traps;
+    s->ucycles = pmcEvents(PMC_UCYCLES);
+    s->kcycles = pmcEvents(PMC_KCYCLES);
+    for (i=0; i < NUM_PMCS; ++i)
+      s->pmclimit[i] = pmcLimit[i];
+    s->pmcen = PMCEN;
+    s->pmovf = PMOVF;
+    s->pending = pendingIRQ;
+    s->tlbidx = tlbIndex;
+    for (i=0; i < NUM_PAGES; ++i)
+      s->tlb[i] = tlb[i];
+    /* uint18 is laid out exactly like an unsigned int. */
+    for (i=0; i <= 0777; ++i)
+      memcpy(s->memory[i], (const void *)memory[i], sizeof s->memory[i]);
+}
+
+extern "C" void restoreMachine(const struct FungusState *s)
+{
+    int i;
+    for (i=0; i < 8; ++i)
+      register_file[i] = uint18(s->regs[i]);
+    HCON = uint18(s->hcon);
+    HCAND = uint18(s->hcand);
+    HCOR = uint18(s->hcor);
+    OSEC = uint18(s->osec);
+    ISTACK = uint18(s->istack);
+    DISTK = uint18(s->distk);
+    HI = uint18(s->hi);
+    DMASRC = uint18(s->dmasrc);
+    DMADST = uint18(s->dmadst);
+    DMASIZE = uint18(s->dmasize);
+    cycle = s->cycle;
+    retired = s->retired;
+    loads = s->loads;
+    stores = s->stores;
+    traps = s->traps;
+    userCycles = s->ucycles;
+    kernelCycles = s->kcycles;
+    modeStart = cycle;
+    inUser = (bool)HCON;
+    for (i=0; i < NUM_PMCS; ++i)
+      pmcLimit[i] = s->pmclimit[i];
+    PMCEN = s->pmcen;
+    PMOVF = s->pmovf;
+    pendingIRQ = s->pending;
+    modeChanged = true;
+    for (i=0; i < NUM_PAGES; ++i)
+      tlbMap(i, s->tlb[i] & (MAX_FRAMES - 1));
+    tlbIndex = s->tlbidx & (NUM_PAGES - 1);
+    tlbDropUnmapped();
+    for (i=0; i <= 0777; ++i)
+      memcpy((void *)columnForWrite(i), s->memory[i], sizeof s->memory[i]);
+}
@@ -5,11 +5,12 @@
 #ifdef __cplusplus
  #include "uint18.h"
  extern uint18 register_file[8];
- extern uint18 memory[0777+1][0777+1];
+ extern uint18 *memory[0777+1];  /* indexed [x][y], through the TLB */
  extern "C" {
 #endif
 
 extern unsigned int cycle;  /* hardware cycle counter */
+extern unsigned long retired;  /* instructions-retired counter */
 extern int DebugPrint;  /* bool: print each instruction as it's executed? */
 
 void initMachine(void);
@@ -17,8 +18,12 @@ void initmem(const char *buffer, int sx, int sy, int width, int height);
 void initmemw(const unsigned int *rombuffer, int sx, int sy, int width, int height);
 void initRAM(const char *rambuffer, int width, int height);
 void initROMw(const unsigned int *rombuffer, int width, int height);
+void fillmem(unsigned int sx, unsigned int sy, unsigned int width,
+             unsigned int height, unsigned int value);
+int attachmem(unsigned int sx, unsigned int ncols, unsigned int *cells);
 
 void run(void);
+void runFor(unsigned int steps);
 void step(void);
 
 void onException(void (*handler)(unsigned int inst));
@@ -32,6 +37,39 @@ unsigned int readmem(unsigned int x, unsigned int y);
 void setReg(unsigned int which, unsigned int value);
 unsigned int readReg(unsigned int which);
 
+/* Provided for the benefit of debuggers. These access the built-in
+ * MSRs directly, bypassing any onReadMSR/onWriteMSR callbacks and
+ * without side effects such as IRET. */
+unsigned int peekMSR(unsigned int msr);
+void pokeMSR(unsigned int msr, unsigned int value);
+
+/* Provided for the benefit of devices. Raises interrupt line 'line'
+ * (0 to 31), which is taken as soon as the machine is in user mode,
+ * vectoring to (0777, 0776-line). Line 0 is the performance counters'. */
+void raiseInterrupt(unsigned int line);
+
+/* Provided for the benefit of test harnesses. A snapshot holds the
+ * whole architectural state of the machine, so that a harness can
+ * rewind it without restarting the process. Registered callbacks are
+ * not part of the state. Memory is indexed [x][y], as it is inside
+ * the simulator, and holds the frames the TLB maps; restoring a
+ * snapshot clears every frame that isn't mapped. */
+struct FungusState {
+    unsigned int regs[8];
+    unsigned int hcon, hcand, hcor, osec, istack, distk, hi;
+    unsigned int dmasrc, dmadst, dmasize;
+    unsigned int cycle;
+    unsigned long retired;
+    unsigned long loads, stores, traps, ucycles, kcycles;
+    unsigned long pmclimit[6];
+    unsigned int pmcen, pmovf, pending;
+    unsigned int tlbidx, tlb[8];
+    unsigned int memory[0777+1][0777+1];
+};
+
+void saveMachine(struct FungusState *state);
+void restoreMachine(const struct FungusState *state);
+
 #ifdef __cplusplus
  }
 #endif
@@ -0,0 +1,291 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define steq(x,y) (!strcmp(x,y))
+#define MAX_RUNS 100
+
+/* The results for one benchmark. 'seconds' is the median over all runs;
+ * 'maxrss_kb' is the worst case. The simulated counts should be the same
+ * on every run, since the machine is deterministic. */
+struct Result {
+    char name[64];
+    double seconds;
+    unsigned long cycles;
+    unsigned long instructions;
+    double ips;
+    long maxrss_kb;
+};
+
+static void run_benchmark(const char *spec, struct Result *res);
+ static double run_once(const char *elf, const char *bf,
+                        unsigned long *cycles, unsigned long *instructions,
+                        long *maxrss_kb);
+static void write_json(const char *fname, const struct Result *res, int nres);
+static int compare(const char *fname, const struct Result *res, int nres);
+static int cmp_double(const void *a, const void *b);
+static void do_error(const char *fmat, ...);
+static void do_help(int man);
+
+
+static const char *Simfunge = "./simfunge.exe";
+static int NumRuns = 5;
+static double Tolerance = 10.0;  /* percent */
+
+int main(int argc, char *argv[])
+{
+    const char *OutputName = NULL;
+    const char *BaselineName = NULL;
+    struct Result *res;
+    int nres, i, rc = 0;
+
+    for (i=1; i < argc; i++)
+    {
+        if (argv[i][0] != '-') break;
+        if (argv[i][1] == '\0') break;
+
+        if (steq(argv[i]+1, "-")) { ++i; break; }
+        else if (steq(argv[i]+1, "?")) do_help(0);
+        else if (steq(argv[i]+1, "-help")) do_help(0);
+        else if (steq(argv[i]+1, "-man")) do_help(1);
+        else if (i >= argc-1) {
+            do_error("Option %s needs an argument\n", argv[i]);
+        } else if (steq(argv[i], "-n")) {
+            NumRuns = atoi(argv[++i]);
+            if (NumRuns < 1 || NumRuns > MAX_RUNS)
+              do_error("Number of runs must be between 1 and %d\n", MAX_RUNS);
+        } else if (steq(argv[i], "-o")) {
+            OutputName = argv[++i];
+        } else if (steq(argv[i], "-c")) {
+            BaselineName = argv[++i];
+        } else if (steq(argv[i], "-t")) {
+            Tolerance = atof(argv[++i]);
+        } else if (steq(argv[i], "-s")) {
+            Simfunge = argv[++i];
+        } else {
+            do_error("Unrecognized option %s\n", argv[i]);
+        }
+    }
+
+    if (i == argc) do_error("No benchmarks to run\n");
+
+    nres = argc - i;
+    res = malloc(nres * sizeof *res);
+    if (res == NULL) do_error("Out of memory");
+
+    printf("%-16s %12s %12s %12s %14s %10s\n", "benchmark",
+        "host sec", "cycles", "instrs", "instrs/sec", "peak RSS");
+    for (; i < argc; ++i) {
+        struct Result *r = &res[nres - (argc - i)];
+        run_benchmark(argv[i], r);
+        printf("%-16s %12.6f %12lu %12lu %14.0f %8ldkB\n", r->name,
+            r->seconds, r->cycles, r->instructions, r->ips, r->maxrss_kb);
+    }
+
+    /* Compare first, in case the baseline is also the output file. */
+    if (BaselineName != NULL)
+      rc = compare(BaselineName, res, nres);
+    if (OutputName != NULL)
+      write_json(OutputName, res, nres);
+    free(res);
+    return rc;
+}
+
+
+/* A benchmark is specified as "kernel.elf" or "kernel.elf:program.bf".
+ * It's named after the last file in the list, minus its extension. */
+static void run_benchmark(const char *spec, struct Result *res)
+{
+    char elf[FILENAME_MAX];
+    const char *bf = NULL;
+    const char *colon = strchr(spec, ':');
+    const char *base;
+    double times[MAX_RUNS];
+    int i;
+
+    if (colon != NULL) {
+        sprintf(elf, "%.*s", (int)(colon - spec), spec);
+        bf = colon+1;
+    } else {
+        sprintf(elf, "%.*s", (int)(sizeof elf - 1), spec);
+    }
+
+    base = strrchr((bf != NULL)? bf: elf, '/');
+    base = (base != NULL)? base+1: (bf != NULL)? bf: elf;
+    sprintf(res->name, "%.*s", (int)(sizeof res->name - 1), base);
+    if (strrchr(res->name, '.') != NULL)
+      *strrchr(res->name, '.') = '\0';
+
+    res->maxrss_kb = 0;
+    for (i=0; i < NumRuns; ++i) {
+        long rss;
+        times[i] = run_once(elf, bf, &res->cycles, &res->instructions, &rss);
+        if (rss > res->maxrss_kb)
+          res->maxrss_kb = rss;
+    }
+    qsort(times, NumRuns, sizeof *times, cmp_double);
+    res->seconds = times[NumRuns/2];
+    res->ips = (res->seconds > 0)? res->instructions / res->seconds: 0;
+}
+
+static double run_once(const char *elf, const char *bf,
+                       unsigned long *cycles, unsigned long *instructions,
+                       long *maxrss_kb)
+{
+    struct timespec t0, t1;
+    struct rusage ru;
+    char buffer[512];
+    const char *line;
+    int fds[2];
+    int len = 0, rc, status;
+    pid_t pid;
+
+    if (pipe(fds) != 0)
+      do_error("Couldn't create a pipe: %s\n", strerror(errno));
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pid = fork();
+    if (pid < 0)
+      do_error("Couldn't fork: %s\n", strerror(errno));
+    if (pid == 0) {
+        /* The program's own output is uninteresting. Its stats line
+         * goes to stderr, which we collect through the pipe. */
+        int devnull = open("/dev/null", O_RDWR);
+        dup2(devnull, 0);
+        dup2(devnull, 1);
+        dup2(fds[1], 2);
+        close(fds[0]);
+        execl(Simfunge, Simfunge, "-s", elf, bf, (char *)NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+    while (len < (int)sizeof buffer - 1) {
+        rc = read(fds[0], buffer+len, sizeof buffer - 1 - len);
+        if (rc <= 0) break;
+        len += rc;
+    }
+    buffer[len] = '\0';
+    close(fds[0]);
+    if (wait4(pid, &status, 0, &ru) != pid)
+      do_error("Lost track of child process: %s\n", strerror(errno));
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127)
+      do_error("Couldn't run \"%s\"\n", Simfunge);
+    line = strstr(buffer, "simfunge: ");
+    if (line == NULL ||
+        sscanf(line, "simfunge: %lu cycles, %lu instructions", cycles, instructions) != 2)
+      do_error("No statistics from \"%s %s %s\"\n", Simfunge, elf, (bf != NULL)? bf: "");
+
+    *maxrss_kb = ru.ru_maxrss;
+    return (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+
+/* One benchmark per line, so that compare() can read it back
+ * without a real JSON parser. */
+static void write_json(const char *fname, const struct Result *res, int nres)
+{
+    FILE *fp = fopen(fname, "w");
+    int i;
+    if (fp == NULL)
+      do_error("Couldn't open output file \"%s\"\n", fname);
+    fprintf(fp, "{\"runs\": %d, \"benchmarks\": [\n", NumRuns);
+    for (i=0; i < nres; ++i) {
+        fprintf(fp, "  {\"name\": \"%s\", \"seconds\": %.6f, \"cycles\": %lu,"
+            " \"instructions\": %lu, \"ips\": %.0f, \"maxrss_kb\": %ld}%s\n",
+            res[i].name, res[i].seconds, res[i].cycles, res[i].instructions,
+            res[i].ips, res[i].maxrss_kb, (i+1 < nres)? ",": "");
+    }
+    fprintf(fp, "]}\n");
+    fclose(fp);
+}
+
+/* Returns 1 if any benchmark got slower than the baseline by more than
+ * the tolerance, or if its simulated cycle count changed at all. */
+static int compare(const char *fname, const struct Result *res, int nres)
+{
+    FILE *fp = fopen(fname, "r");
+    char line[512];
+    int regressions = 0;
+    int i;
+
+    if (fp == NULL)
+      do_error("Couldn't open baseline file \"%s\"\n", fname);
+
+    printf("\n%-16s %12s %12s %8s\n", "benchmark", "baseline", "current", "change");
+    while (fgets(line, sizeof line, fp) != NULL) {
+        struct Result b;
+        const char *verdict = "";
+        double change;
+        if (sscanf(line, " {\"name\": \"%63[^\"]\", \"seconds\": %lf, \"cycles\": %lu,"
+                   " \"instructions\": %lu, \"ips\": %lf, \"maxrss_kb\": %ld}",
+                   b.name, &b.seconds, &b.cycles, &b.instructions,
+                   &b.ips, &b.maxrss_kb) != 6)
+          continue;
+        for (i=0; i < nres; ++i) {
+            if (steq(res[i].name, b.name)) break;
+        }
+        if (i == nres) continue;
+        change = (b.seconds > 0)? 100.0 * (res[i].seconds - b.seconds) / b.seconds: 0;
+        if (res[i].cycles != b.cycles) {
+            verdict = "  CYCLES CHANGED";
+            regressions += 1;
+        } else if (change > Tolerance) {
+            verdict = "  REGRESSION";
+            regressions += 1;
+        }
+        printf("%-16s %12.6f %12.6f %+7.1f%%%s\n", b.name, b.seconds,
+            res[i].seconds, change, verdict);
+    }
+    fclose(fp);
+    return (regressions != 0);
+}
+
+
+static int cmp_double(const void *a, const void *b)
+{
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+    return (da < db)? -1: (da > db);
+}
+
+static void do_error(const char *msg, ...)
+{
+    va_list ap;
+    va_start(ap, msg);
+    printf("Error: ");
+    vprintf(msg, ap);
+    putchar('\n');
+    va_end(ap);
+    exit(EXIT_FAILURE);
+}
+
+static void do_help(int man)
+{
+    puts("Usage: simbench [-n runs] [-o out.json] [-c baseline.json] [-t percent]");
+    puts("                [-s simfunge] kernel.elf[:program.bf] ...");
+    if (man) {
+        puts("");
+        puts("  simbench runs each kernel.elf (with program.bf, if given) under");
+        puts("simfunge -s, several times, and reports the median host time, the");
+        puts("simulated cycles and instructions, instructions per host second,");
+        puts("and the peak resident set size of the simulator.");
+        puts("  -o writes the results as JSON. -c compares the results against a");
+        puts("previously saved JSON file, and flags any benchmark that got slower");
+        puts("by more than the tolerance given with -t (default 10 percent), or");
+        puts("whose simulated cycle count changed. simbench exits with status 1");
+        puts("if it flagged anything.");
+    }
+    exit(EXIT_FAILURE);
+}
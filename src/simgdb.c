@@ -0,0 +1,570 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "fungus.h"
+#include "simgdb.h"
+
+#define GDB_POLL_INTERVAL  65536u  /* steps between checks for a new client */
+#define GDB_INTR_INTERVAL  4096u   /* steps between checks for a ^C */
+#define MAX_BREAKPOINTS    64
+#define MAX_WATCHPOINTS    8
+#define MAX_WATCHLEN       64      /* in cells */
+#define PACKET_SIZE        4096
+#define NUM_GDB_REGS       15
+
+#define SIGINT_REPLY  "S02"
+#define SIGTRAP_REPLY "S05"
+
+static int listenfd = -1;
+static int clientfd = -1;
+
+static unsigned int breakpoints[MAX_BREAKPOINTS];
+static int nbreakpoints = 0;
+
+struct Watchpoint {
+    unsigned int addr, len;
+    unsigned int saved[MAX_WATCHLEN];
+};
+static struct Watchpoint watchpoints[MAX_WATCHPOINTS];
+static int nwatchpoints = 0;
+
+static void try_accept(void);
+static void serve_client(void);
+ static const char *resume(int single);
+  static unsigned int next_pc(void);
+  static int at_breakpoint(unsigned int addr);
+  static int check_watchpoints(char *reply);
+  static int client_interrupted(void);
+ static void handle_packet(char *packet, char *reply);
+  static void read_registers(char *reply);
+  static void write_registers(const char *hex);
+  static unsigned int read_register(int which);
+  static void write_register(int which, unsigned int value);
+  static void read_memory(const char *args, char *reply);
+  static void write_memory(const char *args, char *reply);
+  static void insert_point(const char *args, char *reply);
+  static void remove_point(const char *args, char *reply);
+ static int get_packet(char *buf, int size);
+ static int put_packet(const char *data);
+  static int read_byte(void);
+ static void drop_client(void);
+static void put_word(char *bp, unsigned int value);
+static unsigned int get_word(const char *bp);
+
+
+int gdb_listen(const char *where)
+{
+    int fd;
+    int alldigits = (where[0] != '\0');
+    const char *p;
+
+    for (p = where; *p != '\0'; ++p) {
+        if (*p < '0' || *p > '9')
+          alldigits = 0;
+    }
+
+    if (alldigits) {
+        struct sockaddr_in sin;
+        int yes = 1;
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+        memset(&sin, 0, sizeof sin);
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(atoi(where));
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(fd, (struct sockaddr *)&sin, sizeof sin) != 0) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        struct sockaddr_un sun;
+        if (strlen(where) >= sizeof sun.sun_path)
+          return -1;
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        memset(&sun, 0, sizeof sun);
+        sun.sun_family = AF_UNIX;
+        strcpy(sun.sun_path, where);
+        unlink(where);
+        if (bind(fd, (struct sockaddr *)&sun, sizeof sun) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (listen(fd, 1) != 0 || fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+        close(fd);
+        return -1;
+    }
+    listenfd = fd;
+    return 0;
+}
+
+
+void gdb_run(void)
+{
+    while (1) {
+        if (clientfd < 0) {
+            /* Nobody is attached; run at full speed, and only
+             * look for a new client every so often. */
+            runFor(GDB_POLL_INTERVAL);
+            try_accept();
+        } else {
+            serve_client();
+        }
+    }
+}
+
+static void try_accept(void)
+{
+    int fd = accept(listenfd, NULL, NULL);
+    int yes = 1;
+    if (fd < 0)
+      return;
+    /* The listening socket is non-blocking, but the client isn't. */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+    clientfd = fd;
+}
+
+
+/* The machine is stopped, and a client is attached. Talk to the client
+ * until it detaches; or until the connection drops, in which case we
+ * let the machine run freely again. */
+static void serve_client(void)
+{
+    /* PacketSize is what we'll accept, not counting the NUL. */
+    static char packet[PACKET_SIZE + 1];
+    static char reply[PACKET_SIZE];
+
+    while (clientfd >= 0) {
+        int len = get_packet(packet, sizeof packet);
+        if (len < 0) {
+            drop_client();
+            return;
+        }
+        reply[0] = '\0';
+        switch (packet[0]) {
+            case 'c':
+                strcpy(reply, resume(0));
+                break;
+            case 's':
+                strcpy(reply, resume(1));
+                break;
+            case 'D':
+                put_packet("OK");
+                drop_client();
+                return;
+            case 'k':
+                drop_client();
+                exit(0);
+            default:
+                handle_packet(packet, reply);
+                break;
+        }
+        if (put_packet(reply) != 0) {
+            drop_client();
+            return;
+        }
+    }
+}
+
+static void drop_client(void)
+{
+    close(clientfd);
+    clientfd = -1;
+    nbreakpoints = 0;
+    nwatchpoints = 0;
+}
+
+
+/* Run until something interesting happens. Returns the stop reply.
+ * We always execute at least one instruction, so that continuing
+ * from a breakpoint doesn't immediately stop at the same breakpoint. */
+static const char *resume(int single)
+{
+    static char reply[40];
+    unsigned int n = 0;
+
+    while (1) {
+        step();
+        if (check_watchpoints(reply))
+          return reply;
+        if (single || at_breakpoint(next_pc()))
+          return SIGTRAP_REPLY;
+        if (++n == GDB_INTR_INTERVAL) {
+            n = 0;
+            if (client_interrupted())
+              return SIGINT_REPLY;
+        }
+    }
+}
+
+/* Where will the next step() fetch its instruction from? This mirrors
+ * the PC update at the top of step(). */
+static unsigned int next_pc(void)
+{
+    unsigned int pc = readReg(1);
+    unsigned int dpc = readReg(2);
+    unsigned int x = (pc + dpc) & 0777;
+    unsigned int y = ((pc >> 9) + (dpc >> 9)) & 0777;
+    if (peekMSR(040) != 0) {
+        unsigned int hcand = peekMSR(041);
+        unsigned int hcor = peekMSR(042);
+        x = (x & hcand & 0777) | (hcor & 0777);
+        y = (y & (hcand >> 9) & 0777) | ((hcor >> 9) & 0777);
+    }
+    return (y << 9) | x;
+}
+
+static int at_breakpoint(unsigned int addr)
+{
+    int i;
+    for (i=0; i < nbreakpoints; ++i) {
+        if (breakpoints[i] == addr)
+          return 1;
+    }
+    return 0;
+}
+
+static int check_watchpoints(char *reply)
+{
+    int i;
+    unsigned int j;
+    for (i=0; i < nwatchpoints; ++i) {
+        struct Watchpoint *wp = &watchpoints[i];
+        for (j=0; j < wp->len; ++j) {
+            unsigned int a = (wp->addr + j) & 0777777;
+            unsigned int v = readmem(a & 0777, a >> 9);
+            if (v != wp->saved[j]) {
+                wp->saved[j] = v;
+                sprintf(reply, "T05watch:%x;", a);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Has the client sent us a ^C while we were running? */
+static int client_interrupted(void)
+{
+    struct pollfd pfd;
+    unsigned char ch;
+    pfd.fd = clientfd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) <= 0)
+      return 0;
+    if (read(clientfd, &ch, 1) != 1)
+      return 1;  /* the connection dropped; stop, and notice it later */
+    return (ch == 0x03);
+}
+
+
+static void handle_packet(char *packet, char *reply)
+{
+    switch (packet[0]) {
+        case '?':
+            strcpy(reply, SIGTRAP_REPLY);
+            break;
+        case 'g':
+            read_registers(reply);
+            break;
+        case 'G':
+            write_registers(packet+1);
+            strcpy(reply, "OK");
+            break;
+        case 'p': {
+            int which = strtoul(packet+1, NULL, 16);
+            if (which < 0 || which >= NUM_GDB_REGS)
+              strcpy(reply, "E01");
+            else
+              put_word(reply, read_register(which));
+            break;
+        }
+        case 'P': {
+            char *eq;
+            int which = strtoul(packet+1, &eq, 16);
+            if (*eq != '=' || which < 0 || which >= NUM_GDB_REGS) {
+                strcpy(reply, "E01");
+            } else {
+                write_register(which, get_word(eq+1));
+                strcpy(reply, "OK");
+            }
+            break;
+        }
+        case 'm':
+            read_memory(packet+1, reply);
+            break;
+        case 'M':
+            write_memory(packet+1, reply);
+            break;
+        case 'Z':
+            insert_point(packet+1, reply);
+            break;
+        case 'z':
+            remove_point(packet+1, reply);
+            break;
+        case 'H':
+            strcpy(reply, "OK");
+            break;
+        case 'q':
+            if (!strncmp(packet, "qSupported", 10))
+              sprintf(reply, "PacketSize=%x", PACKET_SIZE);
+            else if (!strcmp(packet, "qAttached"))
+              strcpy(reply, "1");
+            break;
+        default:
+            /* An empty reply means "unsupported". */
+            break;
+    }
+}
+
+static unsigned int read_register(int which)
+{
+    static const unsigned int msrs[] = { 040, 041, 042, 043, 050, 051, 070 };
+    if (which < 8)
+      return readReg(which);
+    return peekMSR(msrs[which-8]);
+}
+
+static void write_register(int which, unsigned int value)
+{
+    static const unsigned int msrs[] = { 040, 041, 042, 043, 050, 051, 070 };
+    if (which < 8)
+      setReg(which, value);
+    else
+      pokeMSR(msrs[which-8], value);
+}
+
+static void read_registers(char *reply)
+{
+    int i;
+    for (i=0; i < NUM_GDB_REGS; ++i)
+      put_word(reply + 8*i, read_register(i));
+}
+
+static void write_registers(const char *hex)
+{
+    int i;
+    for (i=0; i < NUM_GDB_REGS && strlen(hex) >= 8; ++i, hex += 8)
+      write_register(i, get_word(hex));
+}
+
+static void read_memory(const char *args, char *reply)
+{
+    char *comma;
+    unsigned int addr = strtoul(args, &comma, 16);
+    unsigned int len, i;
+    if (*comma != ',') {
+        strcpy(reply, "E01");
+        return;
+    }
+    len = strtoul(comma+1, NULL, 16);
+    if (len > (PACKET_SIZE-1) / 8)
+      len = (PACKET_SIZE-1) / 8;
+    for (i=0; i < len; ++i) {
+        unsigned int a = (addr + i) & 0777777;
+        put_word(reply + 8*i, readmem(a & 0777, a >> 9));
+    }
+}
+
+static void write_memory(const char *args, char *reply)
+{
+    char *comma, *colon;
+    unsigned int addr = strtoul(args, &comma, 16);
+    unsigned int len, i;
+    if (*comma != ',') {
+        strcpy(reply, "E01");
+        return;
+    }
+    len = strtoul(comma+1, &colon, 16);
+    if (*colon != ':' || strlen(colon+1) < 8*len) {
+        strcpy(reply, "E01");
+        return;
+    }
+    for (i=0; i < len; ++i) {
+        unsigned int a = (addr + i) & 0777777;
+        setmem(a & 0777, a >> 9, get_word(colon+1 + 8*i) & 0777777);
+    }
+    strcpy(reply, "OK");
+}
+
+/* Z0 and Z1 (breakpoints) are handled identically; so are
+ * Z2 and Z4 (watchpoints), because a cell that is only read
+ * never changes, and we can't cheaply catch reads. */
+static void insert_point(const char *args, char *reply)
+{
+    char *p;
+    unsigned int addr = strtoul(args+2, &p, 16);
+    unsigned int len = (*p == ',')? strtoul(p+1, NULL, 16): 1;
+    switch (args[0]) {
+        case '0': case '1':
+            if (at_breakpoint(addr)) {
+                strcpy(reply, "OK");
+            } else if (nbreakpoints < MAX_BREAKPOINTS) {
+                breakpoints[nbreakpoints++] = addr;
+                strcpy(reply, "OK");
+            } else {
+                strcpy(reply, "E01");
+            }
+            break;
+        case '2': {
+            struct Watchpoint *wp;
+            unsigned int i;
+            if (nwatchpoints >= MAX_WATCHPOINTS || len == 0 || len > MAX_WATCHLEN) {
+                strcpy(reply, "E01");
+                break;
+            }
+            wp = &watchpoints[nwatchpoints++];
+            wp->addr = addr;
+            wp->len = len;
+            for (i=0; i < len; ++i) {
+                unsigned int a = (addr + i) & 0777777;
+                wp->saved[i] = readmem(a & 0777, a >> 9);
+            }
+            strcpy(reply, "OK");
+            break;
+        }
+        default:
+            /* Read and access watchpoints are unsupported. */
+            break;
+    }
+}
+
+static void remove_point(const char *args, char *reply)
+{
+    char *p;
+    unsigned int addr = strtoul(args+2, &p, 16);
+    int i;
+    switch (args[0]) {
+        case '0': case '1':
+            for (i=0; i < nbreakpoints; ++i) {
+                if (breakpoints[i] == addr)
+                  breakpoints[i--] = breakpoints[--nbreakpoints];
+            }
+            strcpy(reply, "OK");
+            break;
+        case '2':
+            for (i=0; i < nwatchpoints; ++i) {
+                if (watchpoints[i].addr == addr)
+                  watchpoints[i--] = watchpoints[--nwatchpoints];
+            }
+            strcpy(reply, "OK");
+            break;
+        default:
+            break;
+    }
+}
+
+
+/* Read one "$data#cs" packet, acknowledging it. Stray bytes between
+ * packets (acks, and ^C while we're already stopped) are ignored.
+ * Returns the length of the data, or -1 if the connection dropped. */
+static int get_packet(char *buf, int size)
+{
+    while (1) {
+        unsigned char sum = 0;
+        int len = 0;
+        int ch, c1, c2;
+        char hex[3];
+
+        do {
+            ch = read_byte();
+            if (ch < 0) return -1;
+        } while (ch != '$');
+
+        while ((ch = read_byte()) != '#') {
+            if (ch < 0) return -1;
+            if (ch == '$') {
+                len = sum = 0;
+                continue;
+            }
+            sum += ch;
+            if (len < size-1)
+              buf[len++] = ch;
+        }
+        buf[len] = '\0';
+
+        c1 = read_byte();
+        c2 = read_byte();
+        if (c1 < 0 || c2 < 0) return -1;
+        hex[0] = c1; hex[1] = c2; hex[2] = '\0';
+        if (strtoul(hex, NULL, 16) == sum) {
+            if (write(clientfd, "+", 1) != 1) return -1;
+            return len;
+        }
+        if (write(clientfd, "-", 1) != 1) return -1;
+    }
+}
+
+static int put_packet(const char *data)
+{
+    static char buf[PACKET_SIZE + 4];
+    unsigned char sum = 0;
+    int len = strlen(data);
+    int i;
+
+    buf[0] = '$';
+    for (i=0; i < len; ++i) {
+        buf[i+1] = data[i];
+        sum += (unsigned char)data[i];
+    }
+    sprintf(buf+len+1, "#%02x", sum);
+
+    while (1) {
+        int ch;
+        if (write(clientfd, buf, len+4) != len+4)
+          return -1;
+        do {
+            ch = read_byte();
+            if (ch < 0) return -1;
+        } while (ch != '+' && ch != '-');
+        if (ch == '+')
+          return 0;
+    }
+}
+
+static int read_byte(void)
+{
+    unsigned char ch;
+    int rc;
+    do {
+        rc = read(clientfd, &ch, 1);
+    } while (rc < 0 && errno == EINTR);
+    return (rc == 1)? ch: -1;
+}
+
+
+/* Registers and memory cells travel as four little-endian bytes. */
+static void put_word(char *bp, unsigned int value)
+{
+    sprintf(bp, "%02x%02x%02x%02x", value & 0xFF, (value >> 8) & 0xFF,
+        (value >> 16) & 0xFF, (value >> 24) & 0xFF);
+}
+
+static unsigned int get_word(const char *bp)
+{
+    unsigned int value = 0;
+    int i;
+    for (i=3; i >= 0; --i) {
+        char hex[3];
+        hex[0] = bp[2*i];
+        hex[1] = bp[2*i+1];
+        hex[2] = '\0';
+        value = (value << 8) | strtoul(hex, NULL, 16);
+    }
+    return value;
+}
@@ -0,0 +1,37 @@
+
+#ifndef H_SIMGDB
+ #define H_SIMGDB
+
+ #ifdef __cplusplus
+  extern "C" {
+ #endif
+
+/* A GDB remote serial protocol stub for simfunge.
+ *
+ * The stub listens on a local TCP port (if 'where' is all digits) or
+ * on a Unix-domain socket (otherwise). gdb_listen() returns 0 on success
+ * and -1 on failure. gdb_run() replaces run(): it runs the machine in
+ * large chunks, checking only between chunks whether a client wants to
+ * attach, so the stub costs essentially nothing until a debugger
+ * actually connects. It never returns.
+ *
+ * The Fungus machine does not have byte-addressable memory, so the stub
+ * presents memory as a flat array of 512x512 cells, where cell (x,y)
+ * lives at address y*512+x. Lengths in 'm' and 'M' packets count cells,
+ * and each cell is transferred as four little-endian bytes. The register
+ * file is r0..r7, followed by HCON, HCAND, HCOR, OSEC, ISTACK, DISTK,
+ * and the cycle counter; again four little-endian bytes apiece.
+ *   Breakpoints stop the machine just before it fetches the instruction
+ * at the given address. As always on Fungus, $PC then still names the
+ * instruction most recently executed, and the breakpoint is at $PC+$DPC.
+ * Watchpoints are checked after every step while any are set; only
+ * write watchpoints are supported.
+ */
+int gdb_listen(const char *where);
+void gdb_run(void);
+
+ #ifdef __cplusplus
+  }
+ #endif
+
+#endif
@@ -5,35 +5,128 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "fungus.h"
+#include "fungal.h"
 #include "fungelf.h"
+#include "simgdb.h"
+#include "simprof.h"
 
-/* Callbacks for FungELF_load() */
+/* Callbacks for FungELF_loadx() */
 static unsigned int cbgc(int x, int y);
 static int cbsc(int x, int y, unsigned int value);
 static int cbse(int x, int y);
+static int cbfr(int sx, int sy, int w, int h, unsigned int value);
+static int cbcr(int sx, int y, int n, const unsigned int *words);
+static int cbmc(int sx, int ncols, const unsigned int *cells, int fd, long offset);
+static const struct FungELF_Callbacks callbacks = {
+    NULL, cbgc, cbsc, cbse, cbfr, cbcr, cbmc
+};
 
 
 jmp_buf exceptionCaught;
+static const char *gdbwhere = NULL;
+static const char *profname = NULL;
+static const char *blkname = NULL;
+static const char *imagename = NULL;
+static const char *cachedir = NULL;
+#define CACHE_NAME_MAX  FILENAME_MAX
+/* Bump this whenever a change to the loader or the assembler
+ * could change the memory that the same files load as. */
+#define CACHE_VERSION   1
+static int isSource(const char *fname);
+static int loadSource(FILE *fp, const char *fname);
+static int writeImage(const char *fname);
+static int loadCached(int nfiles, char **fnames, char *cachename);
+ static unsigned long hashFiles(int nfiles, char **fnames);
+static void saveCached(const char *cachename);
 static void holler(unsigned int inst);
 static unsigned int readChar(void);
 static void writeChar(int curmode, unsigned int value);
+ static void checkPrintable(int ch);
+static unsigned int readStrPos(void);
+static void writeStrPos(int curmode, unsigned int value);
+static unsigned int readStrDir(void);
+static void writeStrDir(int curmode, unsigned int value);
+static void writeString(int curmode, unsigned int value);
+static void writeStringZ(int curmode, unsigned int value);
+ static void putCells(unsigned long count, int stopAtTerm, unsigned int term);
+ static unsigned int setLanes(unsigned int old, int curmode, unsigned int value);
+static int openBlockDevice(const char *fname);
+static unsigned int readBlkNum(void);
+static void writeBlkNum(int curmode, unsigned int value);
+static unsigned int readBlkRow(void);
+static void writeBlkRow(int curmode, unsigned int value);
+static unsigned int readBlkStatus(void);
+static void writeBlkCmd(int curmode, unsigned int value);
 static void programExit(int curmode, unsigned int value);
+static void printStats(void);
 static void dohelp(int man);
 
 
 int main(int argc, char **argv)
 {
+    static char cachename[CACHE_NAME_MAX];
     FILE *bffp = NULL, *kernfp = NULL;
     int i, rc;
 
     if (argc < 2) dohelp(1);
 
-    if (argc > 2 && !strncmp(argv[1], "-d", 2)) {
-        /* Print debugging information during the run. */
-        DebugPrint = isdigit(argv[1][2])? (argv[1][2] - '0') : 1;
-        --argc;
-        ++argv;
+    while (argc > 2 && argv[1][0] == '-') {
+        if (!strncmp(argv[1], "-d", 2)) {
+            /* Print debugging information during the run. */
+            DebugPrint = isdigit(argv[1][2])? (argv[1][2] - '0') : 1;
+            --argc;
+            ++argv;
+        } else if (!strcmp(argv[1], "-s")) {
+            /* Report the simulated cost of the run on stderr. */
+            atexit(printStats);
+            --argc;
+            ++argv;
+        } else if (!strcmp(argv[1], "-g") && argc > 3) {
+            /* Accept GDB remote-protocol clients on this port or socket. */
+            gdbwhere = argv[2];
+            argc -= 2;
+            argv += 2;
+        } else if (!strcmp(argv[1], "-p") && argc > 3) {
+            /* Write a profile of the guest program to this file. */
+            profname = argv[2];
+            argc -= 2;
+            argv += 2;
+        } else if (!strcmp(argv[1], "-b") && argc > 3) {
+            /* Back the block device with this file. */
+            blkname = argv[2];
+            argc -= 2;
+            argv += 2;
+        } else if (!strcmp(argv[1], "-w") && argc > 3) {
+            /* Write the loaded memory to this file, and exit. */
+            imagename = argv[2];
+            argc -= 2;
+            argv += 2;
+        } else if (!strcmp(argv[1], "-c") && argc > 3) {
+            /* Keep loaded images in this directory, by content. */
+            cachedir = argv[2];
+            argc -= 2;
+            argv += 2;
+        } else if (!strcmp(argv[1], "-m") && argc > 3) {
+            /* Name the profile's hot spots using this symbol map. */
+            if (prof_loadmap(argv[2]) != 0) {
+                printf("Couldn't read symbol map \"%s\"\n", argv[2]);
+                exit(EXIT_FAILURE);
+            }
+            argc -= 2;
+            argv += 2;
+        } else {
+            dohelp(1);
+        }
+    }
+
+    if (gdbwhere != NULL && profname != NULL) {
+        printf("The -g and -p options can't be used together\n");
+        exit(EXIT_FAILURE);
     }
 
     kernfp = fopen(argv[1], "rb");
@@ -50,8 +143,12 @@ int main(int argc, char **argv)
      * memory, the PC will go into an infinite loop, and the
      * simulator will detect the loop and exit noisily.
      *
-     * FungELF_load() reads the bits straight into memory.
+     * FungELF_loadx() reads the bits straight into memory;
+     * fills go through fillmem(), which leaves whole pages lazy.
+     * With -c, a cached image of the same files is mapped instead.
      */
+    if (cachedir != NULL && loadCached(argc-1, argv+1, cachename) == 0)
+      argc = 1;
     for (i=1; i < argc; ++i) {
 	const char *filename = argv[i];
 	FILE *infp = fopen(filename, "rb");
@@ -59,7 +156,10 @@ int main(int argc, char **argv)
 	    printf("Couldn't read from file \"%s\"\n", filename);
 	    dohelp(0);
 	}
-	rc = FungELF_load(infp, NULL, cbgc, cbsc, cbse);
+	if (isSource(filename))
+	  rc = loadSource(infp, filename);
+	else
+	  rc = FungELF_loadx(infp, &callbacks);
 	fclose(infp);
 	if (rc < 0) {
 	    printf("%s in file \"%s\"\n", FungELF_strerror(rc), filename);
@@ -69,6 +169,16 @@ int main(int argc, char **argv)
 		printf("Loaded %d program sections.\n", rc);
 	}
     }
+    if (cachedir != NULL && argc > 1)
+      saveCached(cachename);
+
+    if (imagename != NULL) {
+        if (writeImage(imagename) != 0) {
+            printf("Couldn't write image to \"%s\"\n", imagename);
+            exit(EXIT_FAILURE);
+        }
+        exit(EXIT_SUCCESS);
+    }
 
 
     /* Set up the virtual machine callbacks. */
@@ -76,14 +186,42 @@ int main(int argc, char **argv)
     onReadMSR(0, readChar);
     onWriteMSR(1, writeChar);
     onWriteMSR(2, programExit);
+    onReadMSR(3, readStrPos);
+    onWriteMSR(3, writeStrPos);
+    onReadMSR(4, readStrDir);
+    onWriteMSR(4, writeStrDir);
+    onWriteMSR(5, writeString);
+    onWriteMSR(6, writeStringZ);
+    if (blkname != NULL) {
+        if (openBlockDevice(blkname) != 0) {
+            printf("Couldn't map block device file \"%s\"\n", blkname);
+            exit(EXIT_FAILURE);
+        }
+        onReadMSR(07, readBlkNum);
+        onWriteMSR(07, writeBlkNum);
+        onReadMSR(010, readBlkRow);
+        onWriteMSR(010, writeBlkRow);
+        onReadMSR(011, readBlkStatus);
+        onWriteMSR(011, writeBlkCmd);
+    }
     initMachine();
 
+    if (gdbwhere != NULL && gdb_listen(gdbwhere) != 0) {
+        printf("Couldn't listen for debugger on \"%s\"\n", gdbwhere);
+        exit(EXIT_FAILURE);
+    }
+
     /* The PC is initialized by the ELF loader,
      * when it loads the kernel image. */
 
     switch (setjmp(exceptionCaught)) {
         case 0: /* Set up and run. */
-            run();
+            if (gdbwhere != NULL)
+              gdb_run();
+            else if (profname != NULL)
+              prof_run(profname);
+            else
+              run();
             break; /* NOT REACHED */
         case 42: /* Caught an invalid instruction. */
             printf("The simulator caught an invalid instruction. Quitting...\n");
@@ -115,6 +253,169 @@ static int cbse(int x, int y)
     return 0;
 }
 
+static int cbfr(int sx, int sy, int w, int h, unsigned int value)
+{
+    fillmem(sx, sy, w, h, value);
+    return 0;
+}
+
+static int cbcr(int sx, int y, int n, const unsigned int *words)
+{
+    initmemw(words, sx, y, n, 1);
+    return 0;
+}
+
+/* Map a native image section copy-on-write, straight into memory. */
+static int cbmc(int sx, int ncols, const unsigned int *cells, int fd, long offset)
+{
+    size_t len = (size_t)ncols * 512 * sizeof *cells;
+    void *p;
+    if (fd < 0)
+      return -1;
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, offset);
+    if (p == MAP_FAILED)
+      return -1;
+    if (attachmem(sx, ncols, p) != 0) {
+        munmap(p, len);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Write the whole of memory, as loaded, as a native image that later
+ * runs can map instead of loading. The entry point is the PC. */
+static int writeImage(const char *fname)
+{
+    static unsigned int cells[512*512];
+    FILE *fp = fopen(fname, "wb");
+    int x, y, rc;
+    if (fp == NULL)
+      return -1;
+    for (x=0; x < 512; ++x)
+      for (y=0; y < 512; ++y)
+        cells[x*512 + y] = readmem(x, y);
+    FungELF_stream(fp, 1);
+    FungELF_entrypoint(readReg(1));
+    FungELF_addimage(0, 512, cells);
+    rc = FungELF_writefile(fp);
+    FungELF_done();
+    if (fclose(fp) != 0)
+      rc = -1;
+    return rc;
+}
+
+
+/* A file whose name ends in ".asm" is assembled, not loaded. */
+static int isSource(const char *fname)
+{
+    size_t len = strlen(fname);
+    return (len > 4 && !strcmp(fname + len - 4, ".asm"));
+}
+
+/* Assemble a source file in memory, and load the program straight
+ * from the assembler's output, with no ELF file in between. */
+static int loadSource(FILE *fp, const char *fname)
+{
+    static char errbuf[200];
+    struct FungELF_Image *img;
+    char *text = NULL;
+    size_t len = 0, cap = 0;
+    int rc;
+
+    do {
+        if (len == cap) {
+            text = realloc(text, cap = 2*cap + 65536);
+            if (text == NULL) {
+                printf("Out of memory reading file \"%s\"\n", fname);
+                exit(EXIT_FAILURE);
+            }
+        }
+        rc = fread(text+len, 1, cap-len, fp);
+        len += rc;
+    } while (rc > 0);
+
+    img = fungasm_source(text, len, errbuf, sizeof errbuf);
+    free(text);
+    if (img == NULL) {
+        printf("Error: %s\nin file \"%s\"\n", errbuf, fname);
+        exit(EXIT_FAILURE);
+    }
+    rc = FungELF_loadimage(img, &callbacks);
+    FungELF_freeimage(img);
+    return rc;
+}
+
+
+/* The image cache. Loading the same kernel and program always gives
+ * the same memory, so with -c the loaded memory is kept as a native
+ * image, named after a hash of the files' contents, and later runs
+ * with the same files map that instead. The cache holds nothing
+ * else: the kernel's own startup still runs every time, since it
+ * may already talk to the devices. */
+static unsigned long hashFiles(int nfiles, char **fnames)
+{
+    /* 64-bit FNV-1a, over each file's length and contents and
+     * whether it's assembled, the image format's alignment, and
+     * CACHE_VERSION for everything else that goes into the image. */
+    unsigned long h = 14695981039346656037UL;
+    unsigned char buffer[65536];
+    int i;
+    size_t k, n;
+    h = (h ^ CACHE_VERSION) * 1099511628211UL;
+    h = (h ^ FUNG_IMAGE_ALIGN) * 1099511628211UL;
+    for (i=0; i < nfiles; ++i) {
+        FILE *fp = fopen(fnames[i], "rb");
+        unsigned long len = 0;
+        if (fp == NULL)
+          return 0;
+        h = (h ^ isSource(fnames[i])) * 1099511628211UL;
+        while ((n = fread(buffer, 1, sizeof buffer, fp)) > 0) {
+            for (k=0; k < n; ++k)
+              h = (h ^ buffer[k]) * 1099511628211UL;
+            len += n;
+        }
+        fclose(fp);
+        for (k=0; k < sizeof len; ++k)
+          h = (h ^ ((len >> 8*k) & 0xFF)) * 1099511628211UL;
+    }
+    return h;
+}
+
+/* Returns 0 if the files were loaded from the cache. Otherwise,
+ * 'cachename' is where their image should go, or empty. */
+static int loadCached(int nfiles, char **fnames, char *cachename)
+{
+    unsigned long h = hashFiles(nfiles, fnames);
+    FILE *fp;
+    int rc;
+
+    cachename[0] = '\0';
+    if (h == 0 || strlen(cachedir) > CACHE_NAME_MAX - 40)
+      return -1;
+    sprintf(cachename, "%s/%016lx.elf", cachedir, h);
+    fp = fopen(cachename, "rb");
+    if (fp == NULL)
+      return -1;
+    rc = FungELF_loadelfx(fp, &callbacks);
+    fclose(fp);
+    if (DebugPrint && rc >= 0)
+      printf("Loaded cached image \"%s\".\n", cachename);
+    return (rc >= 0)? 0: -1;
+}
+
+/* Write the image under a temporary name and rename it into place,
+ * so that simultaneous runs never see half an image. */
+static void saveCached(const char *cachename)
+{
+    char tmpname[CACHE_NAME_MAX + 20];
+    if (cachename[0] == '\0')
+      return;
+    sprintf(tmpname, "%s.%ld", cachename, (long)getpid());
+    if (writeImage(tmpname) != 0 || rename(tmpname, cachename) != 0)
+      remove(tmpname);
+}
+
 
 static void holler(unsigned int inst)
 {
@@ -143,19 +444,217 @@ static void writeChar(int curmode, unsigned int value)
 {
     if (curmode == 0 || curmode == 2) {  /* MaskVector, MaskY */
         int ch = (value >> 9) & 0xFF;
-        if (ch != 10 && !isprint(ch)) {
-            printf("writeChar() called with char %dd, which isn't printable\n", ch);
-            exit(0);
-        }
+        checkPrintable(ch);
         putchar(ch);
     }
     if (curmode != 2) {  /* anything but MaskY */
         int ch = value & 0xFF;
+        checkPrintable(ch);
+        putchar(ch);
+    }
+}
+
+static void checkPrintable(int ch)
+{
+    if (ch != 10 && !isprint(ch)) {
+        printf("writeChar() called with char %dd, which isn't printable\n", ch);
+        exit(0);
+    }
+}
+
+
+/* The string output device. The guest sets a start vector in MSR 03
+ * and a direction in MSR 04, then writes a count to MSR 05, or a
+ * terminator value to MSR 06; the device prints the low byte of each
+ * cell along that line, as if by one SMR #1 per cell, and leaves MSR 03
+ * just past the last cell it read. Writing the terminator stops the
+ * output, but doesn't print it. */
+static unsigned int strPos, strDir;
+
+/* Callback for reads from MSR 03. */
+static unsigned int readStrPos(void)
+{
+    return strPos;
+}
+
+/* Callback for writes to MSR 03. */
+static void writeStrPos(int curmode, unsigned int value)
+{
+    strPos = setLanes(strPos, curmode, value);
+}
+
+/* Callback for reads from MSR 04. */
+static unsigned int readStrDir(void)
+{
+    return strDir;
+}
+
+/* Callback for writes to MSR 04. */
+static void writeStrDir(int curmode, unsigned int value)
+{
+    strDir = setLanes(strDir, curmode, value);
+}
+
+/* Callback for writes to MSR 05. */
+static void writeString(int curmode, unsigned int value)
+{
+    (void)curmode;  /* unused */
+    putCells(value & 0777777u, 0, 0);
+}
+
+/* Callback for writes to MSR 06. */
+static void writeStringZ(int curmode, unsigned int value)
+{
+    (void)curmode;  /* unused */
+    putCells(01000000ul, 1, value & 0777777u);
+}
+
+static void putCells(unsigned long count, int stopAtTerm, unsigned int term)
+{
+    char buffer[512];
+    size_t len = 0;
+    unsigned long i;
+    for (i=0; i < count; ++i) {
+        unsigned int x = strPos & 0777, y = (strPos >> 9) & 0777;
+        unsigned int cell = readmem(x, y);
+        int ch = cell & 0xFF;
+        x = (x + strDir) & 0777;
+        y = (y + (strDir >> 9)) & 0777;
+        strPos = (y << 9) | x;
+        if (stopAtTerm && cell == term)
+          break;
+        if (len == sizeof buffer) {
+            fwrite(buffer, 1, len, stdout);
+            len = 0;
+        }
         if (ch != 10 && !isprint(ch)) {
-            printf("writeChar() called with char %dd, which isn't printable\n", ch);
-            exit(0);
+            fwrite(buffer, 1, len, stdout);
+            checkPrintable(ch);
+        }
+        buffer[len++] = ch;
+    }
+    fwrite(buffer, 1, len, stdout);
+}
+
+/* The block device. The file given with -b is a sequence of 512-byte
+ * blocks, and each block is one row of memory, one byte per cell. The
+ * guest selects a block in MSR 07 and a row (by its y coordinate) in
+ * MSR 010, then writes a command to MSR 011: BLK_READ copies the block
+ * into the row, and BLK_WRITE copies the low byte of each cell of the
+ * row into the block. The transfer completes at once; if BLK_IRQ_ON is
+ * also set, interrupt line BLK_IRQ is raised when it does. Reading MSR
+ * 011 gives the status of the last command: 0 for success, or 1 if the
+ * block was past the end of the file, or the file is read-only. */
+#define BLK_SIZE    512
+#define BLK_READ    01
+#define BLK_WRITE   02
+#define BLK_IRQ_ON  04
+#define BLK_IRQ     1
+
+static unsigned char *blkData;
+static size_t blkBytes;
+static int blkWritable;
+static unsigned int blkNum, blkRow, blkStatus;
+
+static int openBlockDevice(const char *fname)
+{
+    struct stat st;
+    int fd = open(fname, O_RDWR);
+    blkWritable = (fd >= 0);
+    if (fd < 0)
+      fd = open(fname, O_RDONLY);
+    if (fd < 0)
+      return -1;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    blkBytes = st.st_size;
+    if (blkBytes != 0) {
+        blkData = mmap(NULL, blkBytes, PROT_READ | (blkWritable ? PROT_WRITE : 0),
+                       MAP_SHARED, fd, 0);
+        if (blkData == MAP_FAILED) {
+            close(fd);
+            return -1;
         }
-        putchar(ch);
+    }
+    close(fd);  /* the mapping stays valid */
+    return 0;
+}
+
+/* Callback for reads from MSR 07. */
+static unsigned int readBlkNum(void)
+{
+    return blkNum;
+}
+
+/* Callback for writes to MSR 07. */
+static void writeBlkNum(int curmode, unsigned int value)
+{
+    blkNum = setLanes(blkNum, curmode, value);
+}
+
+/* Callback for reads from MSR 010. */
+static unsigned int readBlkRow(void)
+{
+    return blkRow;
+}
+
+/* Callback for writes to MSR 010. */
+static void writeBlkRow(int curmode, unsigned int value)
+{
+    blkRow = setLanes(blkRow, curmode, value);
+}
+
+/* Callback for reads from MSR 011. */
+static unsigned int readBlkStatus(void)
+{
+    return blkStatus;
+}
+
+/* Callback for writes to MSR 011. The last block of the file may be
+ * short; it reads as if padded with zeroes, and writes past its end
+ * are dropped, since the file is never extended. */
+static void writeBlkCmd(int curmode, unsigned int value)
+{
+    size_t offset = (size_t)blkNum * BLK_SIZE;
+    size_t len;
+    unsigned int y = (blkRow >> 9) & 0777;
+    unsigned int x;
+    (void)curmode;  /* unused */
+
+    blkStatus = 1;
+    if (offset >= blkBytes)
+      return;
+    len = blkBytes - offset;
+    if (len > BLK_SIZE)
+      len = BLK_SIZE;
+
+    if (value & BLK_READ) {
+        for (x=0; x < BLK_SIZE; ++x)
+          setmem(x, y, (x < len) ? blkData[offset + x] : 0);
+        blkStatus = 0;
+    } else if (value & BLK_WRITE) {
+        if (!blkWritable)
+          return;
+        for (x=0; x < len; ++x)
+          blkData[offset + x] = readmem(x, y) & 0xFF;
+        blkStatus = 0;
+    } else {
+        return;
+    }
+    if (value & BLK_IRQ_ON)
+      raiseInterrupt(BLK_IRQ);
+}
+
+
+/* Writes to a vector-valued device register honor the masking mode. */
+static unsigned int setLanes(unsigned int old, int curmode, unsigned int value)
+{
+    switch (curmode) {
+        case 1: return (old & 0777000u) | (value & 0777u);  /* MaskX */
+        case 2: return (value & 0777000u) | (old & 0777u);  /* MaskY */
+        default: return value & 0777777u;
     }
 }
 
@@ -171,14 +670,47 @@ static void programExit(int curmode, unsigned int value)
     exit(sv);
 }
 
+/* Called at exit, when the -s option is given. The format is
+ * parsed by simbench, so don't change it lightly. */
+static void printStats(void)
+{
+    fflush(stdout);
+    fprintf(stderr, "simfunge: %u cycles, %lu instructions\n", cycle, retired);
+}
+
 
 static void dohelp(int man)
 {
-    puts("Usage: simfunge kernel.elf [program.bf]");
+    puts("Usage: simfunge [-d[N]] [-s] [-g port|socket] [-p profile [-m map]...]");
+    puts("                [-b blockfile] [-w image.elf] [-c cachedir]");
+    puts("                kernel.elf [program.bf]");
     if (man) {
         puts("");
+        puts("  -d prints each instruction as it is executed; -d2 through -d4");
+        puts("select more or less verbose tracing.");
+        puts("  -s reports the number of simulated cycles and instructions on");
+        puts("stderr when the program exits.");
+        puts("  -g accepts GDB remote serial protocol connections on the given");
+        puts("local TCP port, or on the given Unix-domain socket. A debugger");
+        puts("may attach and detach at any time while the program runs.");
+        puts("  -p samples the PC as the program runs, and writes a profile of");
+        puts("where the simulated cycles went to the given file when it exits.");
+        puts("Each -m names a symbol map written by \"fungasm -m\"; the profile");
+        puts("then reports each hot spot by its nearest label.");
+        puts("  -b maps the given file as the guest's block device, which");
+        puts("transfers a 512-byte block to or from a row of memory in a");
+        puts("single MSR write. Writes go straight back to the file.");
+        puts("  -w writes memory, as loaded, to the given file as a native");
+        puts("image, and exits without running anything. Loading that image");
+        puts("instead maps it into memory copy-on-write, rather than reading");
+        puts("it cell by cell.");
+        puts("  -c keeps such an image of each set of input files in the given");
+        puts("directory, named by a hash of their contents; the next run with");
+        puts("the same files maps the image instead of loading the files.");
         puts("  kernel.elf should be a binary file in ELF format, as");
         puts("produced by the fungasm assembler. It will be loaded first.");
+        puts("A file whose name ends in \".asm\" is assembled instead, in");
+        puts("memory, just as fungasm would assemble it, and loaded from there.");
         puts("Think of kernel.elf as a \"kernel\" for the system --- it");
         puts("could be a Befunge interpreter, for example. It will typically");
         puts("occupy \"kernel space\" at the bottom of RAM, although you");
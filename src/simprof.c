@@ -0,0 +1,183 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fungus.h"
+#include "simprof.h"
+
+#define PROF_INTERVAL  61u  /* steps between samples; prime, so as not
+                             * to alias with the period of a tight loop */
+#define MAX_SYMBOLS    4096
+#define HOT_CELLS      20
+
+struct Symbol {
+    unsigned int x, y;
+    char name[64];
+    unsigned long samples, cycles;
+};
+static struct Symbol symbols[MAX_SYMBOLS];
+static int nsymbols = 0;
+
+/* Indexed [x][y], like the simulator's memory. */
+static unsigned long cellSamples[0777+1][0777+1];
+static unsigned long cellCycles[0777+1][0777+1];
+static unsigned long totalSamples, totalCycles;
+
+static const char *outfile;
+
+struct Cell {
+    unsigned int x, y;
+    unsigned long samples, cycles;
+};
+
+static void write_profile(void);
+ static struct Symbol *nearest_symbol(unsigned int x, unsigned int y);
+ static int cmp_symbol(const void *a, const void *b);
+ static int cmp_cell(const void *a, const void *b);
+
+
+int prof_loadmap(const char *fname)
+{
+    FILE *fp = fopen(fname, "r");
+    char line[256];
+    if (fp == NULL)
+      return -1;
+    while (fgets(line, sizeof line, fp) != NULL && nsymbols < MAX_SYMBOLS) {
+        struct Symbol *sp = &symbols[nsymbols];
+        if (sscanf(line, "%o %o %63s", &sp->x, &sp->y, sp->name) != 3)
+          continue;
+        sp->x &= 0777;
+        sp->y &= 0777;
+        nsymbols += 1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+
+void prof_run(const char *outname)
+{
+    unsigned int lastCycle = cycle;
+    outfile = outname;
+    atexit(write_profile);
+    while (1) {
+        unsigned int pc, x, y;
+        runFor(PROF_INTERVAL);
+        pc = readReg(1);
+        x = pc & 0777;
+        y = (pc >> 9) & 0777;
+        cellSamples[x][y] += 1;
+        cellCycles[x][y] += cycle - lastCycle;
+        totalSamples += 1;
+        totalCycles += cycle - lastCycle;
+        lastCycle = cycle;
+    }
+}
+
+
+/* The nearest label at or before the given cell is the natural answer
+ * for a linear machine, but Fungus code runs in every direction; so
+ * we use the closest label as the crow flies (well, as the rook moves).
+ */
+static struct Symbol *nearest_symbol(unsigned int x, unsigned int y)
+{
+    struct Symbol *best = NULL;
+    int bestdist = 0;
+    int i;
+    for (i=0; i < nsymbols; ++i) {
+        int dx = (int)x - (int)symbols[i].x;
+        int dy = (int)y - (int)symbols[i].y;
+        int dist = abs(dx) + abs(dy);
+        if (best == NULL || dist < bestdist) {
+            best = &symbols[i];
+            bestdist = dist;
+        }
+    }
+    return best;
+}
+
+static void write_profile(void)
+{
+    struct Cell *cells;
+    int ncells = 0;
+    unsigned int x, y;
+    int i;
+    FILE *fp;
+
+    fflush(stdout);
+    fp = fopen(outfile, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "simfunge: couldn't write profile to \"%s\"\n", outfile);
+        return;
+    }
+
+    for (x=0; x <= 0777; ++x)
+      for (y=0; y <= 0777; ++y)
+        ncells += (cellSamples[x][y] != 0);
+    cells = malloc((ncells + 1) * sizeof *cells);
+    if (cells == NULL) {
+        fclose(fp);
+        return;
+    }
+    ncells = 0;
+    for (x=0; x <= 0777; ++x) {
+        for (y=0; y <= 0777; ++y) {
+            if (cellSamples[x][y] == 0) continue;
+            cells[ncells].x = x;
+            cells[ncells].y = y;
+            cells[ncells].samples = cellSamples[x][y];
+            cells[ncells].cycles = cellCycles[x][y];
+            ncells += 1;
+            if (nsymbols != 0) {
+                struct Symbol *sp = nearest_symbol(x, y);
+                sp->samples += cellSamples[x][y];
+                sp->cycles += cellCycles[x][y];
+            }
+        }
+    }
+
+    fprintf(fp, "%lu samples, one every %u instructions; %lu cycles\n",
+        totalSamples, PROF_INTERVAL, totalCycles);
+
+    if (nsymbols != 0) {
+        qsort(symbols, nsymbols, sizeof *symbols, cmp_symbol);
+        fprintf(fp, "\n%8s %10s  %s\n", "cycles", "samples", "symbol");
+        for (i=0; i < nsymbols && symbols[i].samples != 0; ++i) {
+            fprintf(fp, "%7.2f%% %10lu  %s\n",
+                100.0 * symbols[i].cycles / (totalCycles ? totalCycles : 1),
+                symbols[i].samples, symbols[i].name);
+        }
+    }
+
+    qsort(cells, ncells, sizeof *cells, cmp_cell);
+    fprintf(fp, "\n%8s %10s  %-9s  %s\n", "cycles", "samples", "location",
+        (nsymbols != 0)? "nearest symbol": "");
+    for (i=0; i < ncells && i < HOT_CELLS; ++i) {
+        fprintf(fp, "%7.2f%% %10lu  (%03o,%03o)",
+            100.0 * cells[i].cycles / (totalCycles ? totalCycles : 1),
+            cells[i].samples, cells[i].x, cells[i].y);
+        if (nsymbols != 0) {
+            struct Symbol *sp = nearest_symbol(cells[i].x, cells[i].y);
+            fprintf(fp, "  %s (%+d,%+d)", sp->name,
+                (int)cells[i].x - (int)sp->x, (int)cells[i].y - (int)sp->y);
+        }
+        fputc('\n', fp);
+    }
+
+    free(cells);
+    fclose(fp);
+}
+
+static int cmp_symbol(const void *a, const void *b)
+{
+    const struct Symbol *sa = a;
+    const struct Symbol *sb = b;
+    return (sa->cycles < sb->cycles) - (sa->cycles > sb->cycles);
+}
+
+static int cmp_cell(const void *a, const void *b)
+{
+    const struct Cell *ca = a;
+    const struct Cell *cb = b;
+    return (ca->cycles < cb->cycles) - (ca->cycles > cb->cycles);
+}
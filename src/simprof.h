@@ -0,0 +1,29 @@
+
+#ifndef H_SIMPROF
+ #define H_SIMPROF
+
+ #ifdef __cplusplus
+  extern "C" {
+ #endif
+
+/* A sampling profiler for simfunge.
+ *
+ * prof_run() replaces run(): it runs the machine in short bursts and,
+ * after each burst, charges the simulated cycles spent in it to the
+ * instruction the PC is on. It never returns; when the program exits,
+ * the profile is written to 'outname'. Host-side profilers such as perf
+ * can't see guest code at all, since the simulator has no generated
+ * code to attribute host cycles to; this is the guest's view instead.
+ *
+ * prof_loadmap() reads a symbol map written by "fungasm -m". Hot spots
+ * are then reported by their nearest label as well as by location.
+ * It returns 0 on success and -1 if the file couldn't be read.
+ */
+int prof_loadmap(const char *fname);
+void prof_run(const char *outname);
+
+ #ifdef __cplusplus
+  }
+ #endif
+
+#endif